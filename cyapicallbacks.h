@@ -44,6 +44,9 @@ void MIDI2_UART_RXISR_EntryCallback(void);
 #define MIDI2_UART_RXISR_EXIT_CALLBACK
 void MIDI2_UART_RXISR_ExitCallback(void);
 
+#define USB_DP_ISR_EXIT_CALLBACK
+void USB_DP_ISR_ExitCallback(void);
+
 
 #endif /*USBFS_MIDI_CYAPICALLBACKS_H*/    
 /* [] END OF FILE */
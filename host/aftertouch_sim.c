@@ -0,0 +1,248 @@
+/*******************************************************************************
+* File Name: aftertouch_sim.c
+*
+* Description:
+*  Preset programming with poly aftertouch against the host build of main.c.
+*  Each event the firmware takes from USB costs simulated time, so the
+*  firmware's own latency counters measure something. Checks that:
+*   - CURVE_BUTTON and AFTERTOUCH_BUTTON only act in preset mode, and the
+*     control panel shows the settings while one of them is held,
+*   - aftertouch is ignored until it is switched on,
+*   - pressure only raises a held key above its velocity level, and easing
+*     off before the note-off keeps the brightest level reached, also when
+*     the peak is still waiting for its interval at the note-off,
+*   - under a dense pressure stream each key is updated at most once per
+*     AFTERTOUCH_INTERVAL_MS, and a note-on still reaches the lights
+*     within a pass,
+*   - the trace holds the applied levels and no poly pressure messages.
+*  Prints the aftertouch event and update rates and the programming latency.
+*
+*******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include "sim_session.h"
+
+#define EVENT_CYCLES            (120u)      /* 5 us per event taken from USB */
+#define INTERVAL_PASSES         (100u)      /* Enough to wait out an interval */
+#define INTERVAL_CYCLES         (BCLK__BUS_CLK__HZ / 100u)  /* AFTERTOUCH_INTERVAL_MS */
+
+#define NUM_CURVES              (3u)
+#define PRESSURE_KEYS           (6u)        /* The last key is struck instead */
+#define STREAM_PASSES           (10000u)    /* 1 s */
+
+static void press(uint8 note) {
+    simQueueMidi(0u, NOTE_ON, note, 100u);
+    runPasses(5u);
+}
+
+static void release(uint8 note) {
+    simQueueMidi(0u, NOTE_OFF, note, 0u);
+    runPasses(5u);
+}
+
+static uint8 level(unsigned key) {
+    return storedBrightnesses[preset][key];
+}
+
+static double perSecond(unsigned long count, uint32 overCycles) {
+    return count * (double) BCLK__BUS_CLK__HZ / overCycles;
+}
+
+int main(void) {
+    static uint8 raw[1u << 17];
+    TraceDump dump;
+    TraceReader reader;
+    TraceRecord record;
+    uint32 lastUpdate[PRESSURE_KEYS];
+    uint32 minInterval = ~0u;
+    uint32 streamStart;
+    uint32 streamCycles;
+    unsigned long long strikeQueued = 0u;
+    unsigned long long worstStrikePasses = 0u;
+    uint8 lastLevel[PRESSURE_KEYS];
+    uint32 eventsBefore;
+    uint32 appliedBefore;
+    uint32 streamEvents;
+    uint32 streamApplied;
+    unsigned long updates = 0u;
+    unsigned strikes = 0u;
+    unsigned fell = 0u;
+    unsigned levels = 0u;
+    unsigned pressures = 0u;
+    uint8 strikeVelocity = 0u;
+    uint8 stateBefore;
+    size_t dumpStart;
+    int decoded;
+    unsigned pass;
+    unsigned k;
+
+    simReset();
+    sim.outEventCycles = EVENT_CYCLES;
+    runPasses(50u);
+
+    /* The settings buttons do nothing outside preset mode */
+    stateBefore = sim.hotLeds;
+    press(CURVE_BUTTON);
+    check(sim.hotLeds == stateBefore, "CURVE_BUTTON shows nothing in playback mode");
+    release(CURVE_BUTTON);
+    press(AFTERTOUCH_BUTTON);
+    release(AFTERTOUCH_BUTTON);
+    check(responseCurve == 0u && aftertouchEnabled == 0u, "settings unchanged outside preset mode");
+
+    press(PROGRAM_BUTTON);
+    release(PROGRAM_BUTTON);
+    press(PRESET_BUTTON);
+    release(PRESET_BUTTON);
+
+    /* In preset mode they step the curve, shown while the button is held */
+    press(CURVE_BUTTON);
+    check(responseCurve == 1u, "CURVE_BUTTON steps the curve in preset mode");
+    check(sim.hotLeds == (1u << 1) && sim.sledMode == 1u, "curve shown while CURVE_BUTTON is held");
+    release(CURVE_BUTTON);
+    check(sim.hotLeds == 0u && sim.sledMode == 0u, "held keys shown again on release");
+    for (k = 1u; k < NUM_CURVES; k++) {
+        press(CURVE_BUTTON);
+        release(CURVE_BUTTON);
+    }
+    check(responseCurve == 0u, "curve wraps back to linear");
+
+    /* Aftertouch is off until switched on */
+    simQueueMidi(0u, NOTE_ON, lightKeys[0], 40u);
+    runPasses(5u);
+    simQueueMidi(0u, POLY_PRESSURE, lightKeys[0], 127u);
+    runPasses(INTERVAL_PASSES + 5u);
+    check(level(0) == 40u && aftertouchEvents == 0u, "pressure ignored while aftertouch is off");
+    release(lightKeys[0]);
+
+    press(AFTERTOUCH_BUTTON);
+    check(aftertouchEnabled == 1u, "AFTERTOUCH_BUTTON switches aftertouch on");
+    check(sim.hotLeds == 0x81u, "aftertouch and curve shown while AFTERTOUCH_BUTTON is held");
+    release(AFTERTOUCH_BUTTON);
+
+    /* Pressure below the velocity level changes nothing */
+    simQueueMidi(0u, NOTE_ON, lightKeys[0], 100u);
+    runPasses(5u);
+    appliedBefore = aftertouchApplied;
+    simQueueMidi(0u, POLY_PRESSURE, lightKeys[0], 60u);
+    runPasses(INTERVAL_PASSES + 5u);
+    check(level(0) == 100u && aftertouchApplied == appliedBefore,
+          "pressure below the velocity level ignored");
+    release(lightKeys[0]);
+
+    /* A peak still waiting for its interval is applied by the note-off */
+    simQueueMidi(0u, NOTE_ON, lightKeys[1], 40u);
+    runPasses(5u);
+    simQueueMidi(0u, POLY_PRESSURE, lightKeys[1], 60u);
+    runPasses(1u);
+    check(level(1) == 60u, "first pressure applied at once");
+    runPasses(1u);
+    simQueueMidi(0u, POLY_PRESSURE, lightKeys[1], 127u);
+    runPasses(1u);
+    check(level(1) == 60u, "next pressure waits for the interval");
+    simQueueMidi(0u, NOTE_OFF, lightKeys[1], 0u);
+    runPasses(1u);
+    check(level(1) == 127u, "note-off applies the pending peak");
+    runPasses(INTERVAL_PASSES);
+    check(level(1) == 127u, "pending peak applied once");
+
+    /* Dense stream: six held keys, one pressure message each per ms, rising
+     * for half a second and easing off for the other half. The seventh key
+     * is struck every 50 ms in between. */
+    for (k = 0u; k < PRESSURE_KEYS; k++) {
+        simQueueMidi(0u, NOTE_ON, lightKeys[k], 20u);
+        lastUpdate[k] = 0u;
+    }
+    runPasses(5u);
+    for (k = 0u; k < PRESSURE_KEYS; k++) {
+        lastLevel[k] = level(k);
+    }
+    eventsBefore = aftertouchEvents;
+    appliedBefore = aftertouchApplied;
+    programLatencyMaxCycles = 0u;
+    streamStart = simDwt.CYCCNT;
+    for (pass = 0u; pass < STREAM_PASSES; pass++) {
+        if (pass % 10u == 0u) {
+            unsigned ms = pass / 10u;
+            uint8 pressure = (uint8) (ms < 500u ? 20u + ms * 107u / 500u : 127u - (ms - 500u) / 5u);
+            for (k = 0u; k < PRESSURE_KEYS; k++) {
+                simQueueMidi(0u, POLY_PRESSURE, lightKeys[k], pressure);
+            }
+        }
+        if (pass % 500u == 250u) {
+            strikeVelocity = (uint8) (30u + strikes % 90u);
+            simQueueMidi(0u, NOTE_ON, lightKeys[6], strikeVelocity);
+            strikeQueued = simPasses;
+            strikes++;
+        } else if (pass % 500u == 450u) {
+            simQueueMidi(0u, NOTE_OFF, lightKeys[6], 0u);
+        }
+        runPasses(1u);
+
+        if (strikeQueued != 0u && sim.lights[6] == strikeVelocity) {
+            if (simPasses - strikeQueued > worstStrikePasses) {
+                worstStrikePasses = simPasses - strikeQueued;
+            }
+            strikeQueued = 0u;
+        }
+        for (k = 0u; k < PRESSURE_KEYS; k++) {
+            if (level(k) < lastLevel[k]) {
+                fell++;
+            } else if (level(k) > lastLevel[k]) {
+                if (lastUpdate[k] != 0u && simDwt.CYCCNT - lastUpdate[k] < minInterval) {
+                    minInterval = simDwt.CYCCNT - lastUpdate[k];
+                }
+                lastUpdate[k] = simDwt.CYCCNT;
+                updates++;
+            }
+            lastLevel[k] = level(k);
+        }
+    }
+    streamCycles = simDwt.CYCCNT - streamStart;
+    streamEvents = aftertouchEvents - eventsBefore;
+    streamApplied = aftertouchApplied - appliedBefore;
+    for (k = 0u; k < PRESSURE_KEYS; k++) {
+        release(lightKeys[k]);
+    }
+
+    printf("aftertouch: %.0f messages/s, %.0f levels/s applied, %.1f per key per s\n",
+           perSecond(streamEvents, streamCycles), perSecond(streamApplied, streamCycles),
+           perSecond(streamApplied, streamCycles) / PRESSURE_KEYS);
+    printf("programming latency: firmware max %lu cycles (%.1f us), note-on to lights %llu passes\n",
+           (unsigned long) programLatencyMaxCycles, programLatencyMaxCycles * 1e6 / BCLK__BUS_CLK__HZ,
+           worstStrikePasses);
+    check(streamEvents == STREAM_PASSES / 10u * PRESSURE_KEYS, "every pressure message counted");
+    check(streamApplied == updates, "applied count matches the level changes");
+    check(minInterval >= INTERVAL_CYCLES, "each key updated at most once per interval");
+    check(fell == 0u, "easing off never lowers a level");
+    for (k = 0u; k < PRESSURE_KEYS; k++) {
+        check(level(k) == 127u, "peak pressure kept after the note-off");
+    }
+    check(strikes > 0u && strikeQueued == 0u && worstStrikePasses <= 1u,
+          "note-on reaches the lights within a pass under the stream");
+    check(programLatencyMaxCycles <= 16u * EVENT_CYCLES,
+          "firmware programming latency within one USB packet");
+
+    /* The trace holds the applied levels, not the pressure messages */
+    dumpStart = requestDump();
+    check(finishDump(), "dump completes");
+    decoded = decodeDump(dumpStart, raw, sizeof(raw), &dump);
+    check(decoded, "dump decodes");
+    if (decoded) {
+        traceReaderInit(&reader, &dump);
+        while (traceNextRecord(&reader, &record) > 0) {
+            if (record.type == TRACE_TAG_AFTERTOUCH) {
+                levels++;
+            } else if (record.type == TRACE_TAG_MIDI && (record.midi[0] & 0xF0u) == POLY_PRESSURE) {
+                pressures++;
+            }
+        }
+        printf("trace: %u record bytes, %u aftertouch levels, %u pressure messages\n",
+               dump.recordBytes, levels, pressures);
+        check(pressures == 0u, "no poly pressure messages in the trace");
+        check(dump.dropped != 0u || levels == aftertouchApplied, "every applied level in the trace");
+        check(dump.numCounters > 7u && dump.counters[6] == aftertouchEvents &&
+              dump.counters[7] == aftertouchApplied, "dump header carries the aftertouch counters");
+    }
+
+    return checkResult();
+}
@@ -0,0 +1,443 @@
+/*******************************************************************************
+* File Name: dmx_sim.c
+*
+* Description:
+*  Checks the DMX512 output of main.c built with DMX_ENABLED. Simulates the
+*  DMX components at bit level: DMX_UART with its 4 byte TX FIFO and shift
+*  register clocked from DMX_Clock, DMX_DMA feeding the FIFO, and the one
+*  shot DMX_Timer. The line level is logged and decoded by a 250 kbaud
+*  receiver, which checks the break, mark-after-break, framing, refresh rate
+*  and slot contents while the firmware main loop renders a crossfade.
+*
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_session.h"
+
+#define NS_PER_US               (1000ull)
+#define PASS_NS                 (100ull * NS_PER_US)
+#define UART_FIFO_DEPTH         (4u)
+#define SLOT_DIVIDER            (11u)       /* 24 MHz / 12 = 8 x 250 kbaud */
+#define BITS_PER_SLOT           (11u)       /* start, 8 data, 2 stop */
+#define MAX_RUNS                (1u << 21)
+#define MAX_PACKETS             (1024u)
+#define NUM_SLOTS               (512u)
+
+/* DMX512-A transmitter timing */
+#define MIN_BREAK_NS            (92ull * NS_PER_US)
+#define MIN_MAB_NS              (12ull * NS_PER_US)
+#define SLOT_BIT_NS             (4ull * NS_PER_US)
+
+extern uint8 dmxFrame[1u + NUM_SLOTS];
+extern volatile uint32 dmxFrameCount;
+void dmxStart(void);
+
+reg8 DMX_UART_TXDATA_REG;
+
+static unsigned long long now = 0u;
+
+/* DMX_Clock and DMX_UART */
+static uint16 clockDivider = SLOT_DIVIDER;
+static uint8 fifo[UART_FIFO_DEPTH];
+static unsigned fifoCount = 0u;
+static unsigned fifoOverflows = 0u;
+static uint8 txStatus = 0u;
+static int shifting = 0;
+static uint16 shiftBits;
+static unsigned shiftBit;
+static unsigned long long bitEnd;
+
+/* Line level as runs of the same level */
+typedef struct {
+    unsigned long long start;
+    unsigned long long end;
+    uint8 level;
+} Run;
+
+static Run runs[MAX_RUNS];
+static size_t numRuns = 0u;
+
+/* DMX_DMA */
+static uint16 dmaLength = 0u;
+static uint16 dmaIndex = 0u;
+static int dmaActive = 0;
+/* What the DMA read for each slot of the frame it is sending, and the light
+ * levels the firmware had written when it read them */
+static uint8 dmaRead[1u + NUM_SLOTS];
+static uint8 dmaLights[1u + NUM_SLOTS];
+
+/* DMX_Timer */
+static uint16 timerCounter = 0u;
+static int timerArmed = 0;
+static unsigned long long timerExpiry;
+
+static cyisraddress doneIsr = NULL;
+static cyisraddress timerIsr = NULL;
+
+/* Frames as read by the DMA, matched to the decoded packets in order */
+typedef struct {
+    uint8 slots[1u + NUM_SLOTS];
+    uint8 lights[1u + NUM_SLOTS];
+} DmaFrame;
+
+static DmaFrame dmaFrames[MAX_PACKETS];
+static unsigned numDmaFrames = 0u;
+
+static void lineLevel(uint8 level, unsigned long long start, unsigned long long end) {
+    if (numRuns > 0u && runs[numRuns - 1u].level == level && runs[numRuns - 1u].end == start) {
+        runs[numRuns - 1u].end = end;
+        return;
+    }
+    if (numRuns == MAX_RUNS) {
+        fprintf(stderr, "line log full\n");
+        exit(2);
+    }
+    runs[numRuns].start = start;
+    runs[numRuns].end = end;
+    runs[numRuns].level = level;
+    numRuns++;
+}
+
+static unsigned long long bitNs(void) {
+    /* UART clock is 8x the bit rate */
+    return (clockDivider + 1ull) * 8ull * NS_PER_US / 24ull;
+}
+
+static void startBit(void) {
+    uint8 level = (shiftBits >> shiftBit) & 1u;
+    bitEnd = now + bitNs();
+    lineLevel(level, now, bitEnd);
+}
+
+static void dmaPump(void);
+
+static void loadShiftRegister(void) {
+    if (!shifting && fifoCount > 0u) {
+        uint8 value = fifo[0];
+        memmove(fifo, &fifo[1], --fifoCount);
+        /* Idle line is high */
+        if (numRuns > 0u && runs[numRuns - 1u].end < now) {
+            lineLevel(1u, runs[numRuns - 1u].end, now);
+        }
+        shiftBits = (uint16) ((value << 1) | (3u << 9));
+        shiftBit = 0u;
+        shifting = 1;
+        startBit();
+        dmaPump();
+    }
+}
+
+static void dmaPump(void) {
+    while (dmaActive && fifoCount < UART_FIFO_DEPTH) {
+        dmaRead[dmaIndex] = dmxFrame[dmaIndex];
+        dmaLights[dmaIndex] = (dmaIndex >= 1u && dmaIndex <= FW_NUM_LIGHTS) ? sim.lights[dmaIndex - 1u] : 0u;
+        fifo[fifoCount++] = dmxFrame[dmaIndex++];
+        if (dmaIndex == dmaLength) {
+            dmaActive = 0;
+            if (numDmaFrames < MAX_PACKETS) {
+                memcpy(dmaFrames[numDmaFrames].slots, dmaRead, sizeof(dmaRead));
+                memcpy(dmaFrames[numDmaFrames].lights, dmaLights, sizeof(dmaLights));
+                numDmaFrames++;
+            }
+            loadShiftRegister();
+            if (doneIsr != NULL) {
+                doneIsr();
+            }
+        }
+    }
+    loadShiftRegister();
+}
+
+static void bitDone(void) {
+    now = bitEnd;
+    shiftBit++;
+    if (shiftBit < BITS_PER_SLOT) {
+        startBit();
+        return;
+    }
+    shifting = 0;
+    txStatus |= DMX_UART_TX_STS_COMPLETE;
+    loadShiftRegister();
+}
+
+void DMX_UART_Start(void) {}
+
+void DMX_UART_WriteTxData(uint8 txDataByte) {
+    if (fifoCount == UART_FIFO_DEPTH) {
+        fifoOverflows++;
+        return;
+    }
+    fifo[fifoCount++] = txDataByte;
+    loadShiftRegister();
+}
+
+uint8 DMX_UART_ReadTxStatus(void) {
+    uint8 status = txStatus;
+    txStatus = 0u;
+    if (fifoCount == 0u) {
+        status |= DMX_UART_TX_STS_FIFO_EMPTY;
+    }
+    if (fifoCount == UART_FIFO_DEPTH) {
+        status |= DMX_UART_TX_STS_FIFO_FULL;
+    } else {
+        status |= DMX_UART_TX_STS_FIFO_NOT_FULL;
+    }
+    return status;
+}
+
+uint16 DMX_Clock_GetDividerRegister(void) { return clockDivider; }
+
+/* Takes effect from the next bit the UART starts */
+void DMX_Clock_SetDividerRegister(uint16 clkDivider, uint8 restart) {
+    (void) restart;
+    clockDivider = clkDivider;
+}
+
+void DMX_Timer_Start(void) {}
+void DMX_Timer_Stop(void) { timerArmed = 0; }
+void DMX_Timer_WriteCounter(uint16 counter) { timerCounter = counter; }
+uint8 DMX_Timer_ReadStatusRegister(void) { return 0u; }
+
+void DMX_Timer_Enable(void) {
+    timerArmed = 1;
+    timerExpiry = now + timerCounter * NS_PER_US;
+}
+
+void DMX_Done_isr_StartEx(cyisraddress address) { doneIsr = address; }
+void DMX_Timer_isr_StartEx(cyisraddress address) { timerIsr = address; }
+
+uint8 DMX_DMA_DmaInitialize(uint8 burstCount, uint8 requestPerBurst, uint16 upperSrcAddress,
+                            uint16 upperDestAddress) {
+    (void) burstCount;
+    (void) requestPerBurst;
+    (void) upperSrcAddress;
+    (void) upperDestAddress;
+    return 0u;
+}
+
+uint8 CyDmaTdAllocate(void) { return 0u; }
+
+uint8 CyDmaTdSetConfiguration(uint8 tdHandle, uint16 transferCount, uint8 nextTd, uint8 configuration) {
+    (void) tdHandle;
+    (void) nextTd;
+    (void) configuration;
+    dmaLength = transferCount;
+    return 0u;
+}
+
+/* The source is always dmxFrame; the host can't rebuild a pointer from 16 bits */
+uint8 CyDmaTdSetAddress(uint8 tdHandle, uint16 source, uint16 destination) {
+    (void) tdHandle;
+    (void) source;
+    (void) destination;
+    return 0u;
+}
+
+uint8 CyDmaChSetInitialTd(uint8 chHandle, uint8 startTd) {
+    (void) chHandle;
+    (void) startTd;
+    return 0u;
+}
+
+uint8 CyDmaChEnable(uint8 chHandle, uint8 preserveTds) {
+    (void) chHandle;
+    (void) preserveTds;
+    dmaIndex = 0u;
+    dmaActive = 1;
+    dmaPump();
+    return 0u;
+}
+
+/* Runs the firmware and the DMX hardware until the given time */
+static unsigned long long nextPass = 0u;
+
+static void runUntil(unsigned long long end) {
+    while (now < end) {
+        unsigned long long next = nextPass;
+        if (shifting && bitEnd < next) {
+            next = bitEnd;
+        }
+        if (timerArmed && timerExpiry < next) {
+            next = timerExpiry;
+        }
+        if (next > end) {
+            now = end;
+            break;
+        }
+        if (shifting && next == bitEnd) {
+            bitDone();
+        } else if (timerArmed && next == timerExpiry) {
+            now = next;
+            timerArmed = 0;
+            timerIsr();
+        } else {
+            now = next;
+            nextPass += PASS_NS;
+            simAdvanceCycles(SIM_CYCLES_PER_PASS);
+            serviceMainLoop();
+        }
+    }
+}
+
+/*******************************************************************************
+* Receiver
+*******************************************************************************/
+typedef struct {
+    unsigned long long breakStart;
+    unsigned long long breakNs;
+    unsigned long long mabNs;
+    unsigned numSlots;          /* Including the start code */
+    unsigned framingErrors;
+    uint8 slots[1u + NUM_SLOTS];
+} Packet;
+
+static Packet packets[MAX_PACKETS];
+static unsigned numPackets = 0u;
+
+static uint8 levelAt(size_t *run, unsigned long long t) {
+    while (*run + 1u < numRuns && runs[*run].end <= t) {
+        (*run)++;
+    }
+    if (t >= runs[*run].end) {
+        return 1u;
+    }
+    return runs[*run].level;
+}
+
+static void receive(void) {
+    Packet *packet = NULL;
+    size_t i = 0u;
+
+    while (i < numRuns && numPackets < MAX_PACKETS) {
+        const Run *run = &runs[i];
+        unsigned long long t0;
+        size_t sample;
+        uint8 value = 0u;
+        unsigned k;
+
+        if (run->level != 0u) {
+            i++;
+            continue;
+        }
+        t0 = run->start;
+        if (run->end - run->start >= 88ull * NS_PER_US) {
+            packet = &packets[numPackets++];
+            memset(packet, 0, sizeof(*packet));
+            packet->breakStart = t0;
+            packet->breakNs = run->end - run->start;
+            packet->mabNs = (i + 1u < numRuns) ? runs[i + 1u].end - runs[i + 1u].start : 0u;
+            i += 2u;
+            continue;
+        }
+        /* A slot: sample the middle of each bit after the start bit */
+        sample = i;
+        for (k = 1u; k <= 8u; k++) {
+            value |= levelAt(&sample, t0 + k * SLOT_BIT_NS + SLOT_BIT_NS / 2u) << (k - 1u);
+        }
+        if (packet != NULL) {
+            if (levelAt(&sample, t0 + 9u * SLOT_BIT_NS + SLOT_BIT_NS / 2u) != 1u ||
+                levelAt(&sample, t0 + 10u * SLOT_BIT_NS + SLOT_BIT_NS / 2u) != 1u) {
+                packet->framingErrors++;
+            }
+            if (packet->numSlots <= NUM_SLOTS) {
+                packet->slots[packet->numSlots] = value;
+            }
+            packet->numSlots++;
+        }
+        /* Resume at the first stop bit */
+        i = sample;
+        while (i < numRuns && runs[i].end <= t0 + 9u * SLOT_BIT_NS + SLOT_BIT_NS / 2u) {
+            i++;
+        }
+        if (i < numRuns && runs[i].level == 0u) {
+            /* Framing error: no stop bit, skip this low run */
+            i++;
+        }
+    }
+}
+
+/*******************************************************************************
+* Scenario
+*******************************************************************************/
+int main(void) {
+    unsigned long long minBreak = ~0ull;
+    unsigned long long minMab = ~0ull;
+    unsigned long long maxPeriod = 0u;
+    unsigned framingErrors = 0u;
+    unsigned badSlotCounts = 0u;
+    unsigned contentErrors = 0u;
+    unsigned fullPackets;
+    unsigned value;
+    double rate;
+    unsigned p;
+    unsigned s;
+
+    simReset();
+    dmxStart();
+
+    /* Start a crossfade and sweep it slowly, so slots change between packets */
+    runUntil(50ull * 1000u * NS_PER_US);
+    simQueueMidi(0u, NOTE_ON, PLAY_PAUSE_BUTTON, 100u);
+    sim.crossfadeVal = 0u;
+    runUntil(now + PASS_NS);
+    simQueueMidi(0u, NOTE_OFF, PLAY_PAUSE_BUTTON, 0u);
+    for (value = 0u; value <= 255u; value += 5u) {
+        sim.crossfadeVal = (uint8) value;
+        runUntil(now + 7ull * 1000u * NS_PER_US);
+    }
+    sim.crossfadeVal = 255u;
+    runUntil(now + 200ull * 1000u * NS_PER_US);
+    receive();
+
+    /* The first and last packets may be cut off by the start and end of the run */
+    check(numPackets > 20u, "packets were sent");
+    fullPackets = numPackets > 2u ? numPackets - 2u : 0u;
+    for (p = 1u; p <= fullPackets; p++) {
+        const Packet *packet = &packets[p];
+        unsigned long long period = packets[p + 1u].breakStart - packet->breakStart;
+        if (packet->breakNs < minBreak) {
+            minBreak = packet->breakNs;
+        }
+        if (packet->mabNs < minMab) {
+            minMab = packet->mabNs;
+        }
+        if (period > maxPeriod) {
+            maxPeriod = period;
+        }
+        framingErrors += packet->framingErrors;
+        if (packet->numSlots != 1u + NUM_SLOTS) {
+            badSlotCounts++;
+            continue;
+        }
+        /* Packet p carries the frame the DMA read p-th */
+        for (s = 0u; s <= NUM_SLOTS && p < numDmaFrames; s++) {
+            uint8 expected = (s >= 1u && s <= FW_NUM_LIGHTS) ? dmaFrames[p].lights[s] : 0u;
+            if (packet->slots[s] != dmaFrames[p].slots[s] || packet->slots[s] != expected) {
+                contentErrors++;
+            }
+        }
+    }
+    rate = fullPackets > 0u ?
+        fullPackets * 1e9 / (double) (packets[fullPackets + 1u].breakStart - packets[1].breakStart) : 0.0;
+
+    printf("%u packets, break >= %.1f us, MAB >= %.1f us, period <= %.2f ms, %.1f Hz, "
+           "%u framing errors, %u short or long packets, %u slot mismatches, "
+           "%u FIFO overflows, %u DMA frames\n",
+           numPackets, minBreak / 1000.0, minMab / 1000.0, maxPeriod / 1e6, rate,
+           framingErrors, badSlotCounts, contentErrors, fifoOverflows, dmxFrameCount);
+
+    check(minBreak >= MIN_BREAK_NS, "break is at least 92 us");
+    check(minMab >= MIN_MAB_NS, "mark after break is at least 12 us");
+    check(maxPeriod <= 1000ull * 1000u * NS_PER_US, "a packet at least every second");
+    check(rate >= 40.0 && rate <= 44.2, "refresh at about 43 Hz");
+    check(framingErrors == 0u, "every slot has two stop bits");
+    check(badSlotCounts == 0u, "start code and 512 slots in every packet");
+    check(contentErrors == 0u, "slots carry the patched light levels");
+    check(fifoOverflows == 0u, "break byte never written to a full FIFO");
+    check(dmxFrameCount == numDmaFrames, "dmxFrameCount counts the DMA frames");
+    check(packets[fullPackets].slots[1] != packets[1].slots[1] ||
+          packets[fullPackets].slots[7] != packets[1].slots[7], "slots follow the crossfade");
+
+    return checkResult();
+}
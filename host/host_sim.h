@@ -0,0 +1,118 @@
+/*******************************************************************************
+* File Name: host_sim.h
+*
+* Description:
+*  State of the simulated PSoC hardware behind psoc/project.h, and the
+*  firmware functions and globals the host programs drive directly.
+*
+*******************************************************************************/
+#if !defined(HOST_SIM_H)
+#define HOST_SIM_H
+
+#include <stddef.h>
+#include "project.h"
+
+#define SIM_MIDI_QUEUE_SIZE     (4096u)
+#define SIM_IN_LOG_SIZE         (1u << 20)
+#define SIM_IN_PENDING_SIZE     (256u)
+
+typedef struct {
+    uint8 cable;
+    uint8 msg[3];
+} SimMidiEvent;
+
+typedef struct {
+    /* USB bus */
+    uint8 configured;
+    uint8 configChanged;
+    uint8 busActive;
+    uint8 suspended;
+    /* Host to device events, handed to the firmware by USB_MIDI_OUT_Service */
+    SimMidiEvent outQueue[SIM_MIDI_QUEUE_SIZE];
+    size_t outHead;
+    size_t outTail;
+    size_t outDelivered;
+    /* Cycles each delivered event takes, so time passes within a packet */
+    uint32 outEventCycles;
+    /* Device to host bytes: queued by USB_PutUsbMidiIn, sent to inLog by
+     * USB_MIDI_IN_Service and discarded by USB_MIDI_Init */
+    uint8 inPending[SIM_IN_PENDING_SIZE];
+    size_t inPendingLen;
+    uint8 inLog[SIM_IN_LOG_SIZE];
+    size_t inLogLen;
+    size_t inDiscarded;
+    unsigned putUsbMidiInCalls;
+    unsigned putUsbMidiInBusyEvery;
+    unsigned midiInitCalls;
+    /* Lights and control panel as last written */
+    uint8 lights[7];
+    uint8 hotLeds;
+    uint8 sledMode;
+    /* Inputs */
+    uint8 crossfadeVal;
+    uint8 switches;
+    uint8 potValue;
+    uint8 potReady;
+    uint8 masterPot;
+    uint8 masterReady;
+    /* Sleep timer ISR registered by the firmware */
+    cyisraddress sleepIsr;
+    /* Interrupts: PRIMASK and the pending Dp (resume) and SleepTimer ones */
+    uint8 primask;
+    uint8 dpPending;
+    uint8 sleepPending;
+    /* If set, the Dp interrupt is raised at that many-th masking from now */
+    unsigned raiseDpAtMask;
+    /* If set, the Dp interrupt is raised just before the next WFI */
+    uint8 raiseDpBeforeWfi;
+    /* Called by __WFI() to let simulated time pass until an interrupt */
+    void (*wfi)(void);
+    unsigned wfiCalls;
+} HostSim;
+
+extern HostSim sim;
+extern DWT_Type simDwt;
+
+void simReset(void);
+void simQueueMidi(uint8 cable, uint8 status, uint8 data1, uint8 data2);
+void simAdvanceCycles(uint32 cycles);
+void simRaiseDp(void);
+void simRaiseSleepTick(void);
+
+/* Firmware (main.c) */
+#define FW_FRAME_SIZE           (8u)
+#define FW_NUM_LIGHTS           (7u)
+
+extern uint8 outputFrame[FW_FRAME_SIZE];
+extern uint8 outputSledMode;
+extern uint8 storedBrightnesses[8][7];
+extern uint8 mode;
+extern uint8 preset;
+extern uint8 playback_preset;
+extern uint8 last_preset;
+extern short crossfading;
+extern uint8 hotLeds;
+extern uint8 master_level;
+extern uint8 responseCurve;
+extern uint8 aftertouchEnabled;
+extern uint8 settingsShown;
+extern volatile uint8 aftertouchPending[FW_NUM_LIGHTS];
+extern uint32 aftertouchEvents;
+extern uint32 aftertouchApplied;
+extern uint32 programLatencyCycles;
+extern uint32 programLatencyMaxCycles;
+extern uint8 traceLastCrossfade;
+extern uint8 traceLastSwitches;
+extern uint8 traceDumping;
+extern uint8 usbSuspended;
+extern volatile uint8 usbResumePending;
+extern uint32 usbWakeCycles;
+extern uint32 usbWakeMaxCycles;
+
+void serviceMainLoop(void);
+void renderOutputFrame(void);
+void setMasterLevel(uint8 level);
+void applyAftertouch(uint8 key, uint8 level);
+void USB_DP_ISR_ExitCallback(void);
+
+#endif /* HOST_SIM_H */
@@ -0,0 +1,170 @@
+/*******************************************************************************
+* File Name: project.h
+*
+* Description:
+*  Host stand-in for the PSoC Creator generated project.h. Declares just the
+*  component APIs, registers and macros that main.c uses, so the firmware can
+*  be compiled and driven on a PC. The APIs are implemented by psoc_stub.c,
+*  whose state the host programs control through host_sim.h.
+*
+*******************************************************************************/
+#if !defined(HOST_PROJECT_H)
+#define HOST_PROJECT_H
+
+#include <stdint.h>
+
+typedef uint8_t  uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t   int8;
+typedef int16_t  int16;
+typedef int32_t  int32;
+typedef volatile uint8 reg8;
+
+#define CYCODE
+#define CYREENTRANT
+#define CY_ISR(FuncName)        void FuncName(void)
+#define CY_ISR_PROTO(FuncName)  void FuncName(void)
+typedef void (*cyisraddress)(void);
+
+#define CyGlobalIntEnable
+
+#define LO8(x)                  ((uint8) ((x) & 0xFFu))
+#define HI8(x)                  ((uint8) ((uint16)(x) >> 8))
+#define LO16(x)                 ((uint16) ((x) & 0xFFFFu))
+#define HI16(x)                 ((uint16) ((uint32)(x) >> 16))
+
+#define BCLK__BUS_CLK__HZ       (24000000u)
+
+/* Cortex-M3 debug and trace registers */
+typedef struct {
+    volatile uint32 CTRL;
+    volatile uint32 CYCCNT;
+} DWT_Type;
+
+typedef struct {
+    volatile uint32 DEMCR;
+} CoreDebug_Type;
+
+extern DWT_Type *DWT;
+extern CoreDebug_Type *CoreDebug;
+
+#define CoreDebug_DEMCR_TRCENA_Msk  (1u << 24)
+#define DWT_CTRL_CYCCNTENA_Msk      (1u)
+
+void __WFI(void);
+uint8 CyEnterCriticalSection(void);
+void CyExitCriticalSection(uint8 savedIntrStatus);
+
+/* USBFS */
+#define USB_FALSE                   (0u)
+#define USB_TRUE                    (1u)
+#define USB_DWR_VDDD_OPERATION      (0u)
+#define USB_EP_MANAGEMENT_DMA_AUTO  (0u)
+#define USB_MIDI_EXT_MODE           (0u)
+#define USB_ONE_EXT_INTRF           (1u)
+#define USB_TWO_EXT_INTRF           (2u)
+#define USB_MIDI_CABLE_00           (0u)
+#define USB_MIDI_CABLE_01           (1u)
+#define USB_INQ_IDENTITY_REQ_FLAG   (0x01u)
+#define USB_MIDI_NOTE_OFF           (0x80u)
+#define USB_MIDI_NOTE_ON            (0x90u)
+#define USB_MIDI_POLY_KEY_PRESSURE  (0xA0u)
+
+void USB_Start(uint8 device, uint8 mode);
+uint8 USB_IsConfigurationChanged(void);
+uint8 USB_GetConfiguration(void);
+uint8 USB_CheckActivity(void);
+void USB_MIDI_Init(void);
+void USB_MIDI_IN_Service(void);
+void USB_MIDI_OUT_Service(void);
+uint8 USB_PutUsbMidiIn(uint8 ic, const uint8 midiMsg[], uint8 cable);
+void USB_Suspend(void);
+void USB_Resume(void);
+void USB_callbackLocalMidiEvent(uint8 cable, uint8 *midiMsg);
+
+/* Sleep timer */
+void Sleep_isr_StartEx(cyisraddress address);
+void SleepTimer_Start(void);
+void SleepTimer_Stop(void);
+uint8 SleepTimer_GetStatus(void);
+
+/* Lights and control panel */
+void BRIGHTNESS_RAMP_Start(void);
+void TRIANGLE_SEL_Start(void);
+void RAMP_COMP_Start(void);
+void LEDs_Out_1_Start(void);
+void Lights_Out_1_Start(void);
+void Lights_Out_1_Poll(void);
+void LIGHT_BRIGHTNESS_1_Write(uint8 value);
+void LIGHT_BRIGHTNESS_2_Write(uint8 value);
+void LIGHT_BRIGHTNESS_3_Write(uint8 value);
+void LIGHT_BRIGHTNESS_4_Write(uint8 value);
+void LIGHT_BRIGHTNESS_5_Write(uint8 value);
+void LIGHT_BRIGHTNESS_6_Write(uint8 value);
+void LIGHT_BRIGHTNESS_7_Write(uint8 value);
+void SLED_STATE_SEL_Write(uint8 value);
+void HOT_LEDS_Write(uint8 value);
+
+/* Crossfade */
+uint8 CROSSFADE_VAL_Read(void);
+void CROSSFADE_CTRL_Write(uint8 value);
+void Crossfade_Clock_SetDividerRegister(uint16 clkDivider, uint8 restart);
+
+/* Preset switches */
+uint8 SW1_Read(void);
+uint8 SW2_Read(void);
+uint8 SW3_Read(void);
+uint8 SW4_Read(void);
+uint8 SW5_Read(void);
+uint8 SW6_Read(void);
+uint8 SW7_Read(void);
+uint8 SW8_Read(void);
+
+/* Potentiometers */
+#define POT_VALUE_RETURN_STATUS     (1u)
+void POT_VALUE_Start(void);
+void POT_VALUE_StartConvert(void);
+uint8 POT_VALUE_IsEndConversion(uint8 retMode);
+uint8 POT_VALUE_GetResult8(void);
+void MASTER_POT_Start(void);
+void MASTER_POT_StartConvert(void);
+uint8 MASTER_POT_IsEndConversion(uint8 retMode);
+uint8 MASTER_POT_GetResult8(void);
+
+/* DMX512 output, used when main.c is built with DMX_ENABLED. Simulated by
+ * dmx_sim.c. */
+#define CY_UART_DMX_UART_H
+#define DMX_UART_TX_STS_COMPLETE    (0x01u)
+#define DMX_UART_TX_STS_FIFO_EMPTY  (0x02u)
+#define DMX_UART_TX_STS_FIFO_FULL   (0x04u)
+#define DMX_UART_TX_STS_FIFO_NOT_FULL (0x08u)
+extern reg8 DMX_UART_TXDATA_REG;
+#define DMX_UART_TXDATA_PTR         (&DMX_UART_TXDATA_REG)
+void DMX_UART_Start(void);
+void DMX_UART_WriteTxData(uint8 txDataByte);
+uint8 DMX_UART_ReadTxStatus(void);
+uint16 DMX_Clock_GetDividerRegister(void);
+void DMX_Clock_SetDividerRegister(uint16 clkDivider, uint8 restart);
+void DMX_Timer_Start(void);
+void DMX_Timer_Stop(void);
+void DMX_Timer_Enable(void);
+void DMX_Timer_WriteCounter(uint16 counter);
+uint8 DMX_Timer_ReadStatusRegister(void);
+void DMX_Done_isr_StartEx(cyisraddress address);
+void DMX_Timer_isr_StartEx(cyisraddress address);
+
+#define CYDEV_SRAM_BASE             (0x1FFF8000u)
+#define CYDEV_PERIPH_BASE           (0x40000000u)
+#define CY_DMA_DISABLE_TD           (0xFEu)
+#define TD_INC_SRC_ADR              (0x08u)
+#define DMX_DMA__TD_TERMOUT_EN      (0x02u)
+uint8 DMX_DMA_DmaInitialize(uint8 burstCount, uint8 requestPerBurst, uint16 upperSrcAddress,
+                            uint16 upperDestAddress);
+uint8 CyDmaTdAllocate(void);
+uint8 CyDmaTdSetConfiguration(uint8 tdHandle, uint16 transferCount, uint8 nextTd, uint8 configuration);
+uint8 CyDmaTdSetAddress(uint8 tdHandle, uint16 source, uint16 destination);
+uint8 CyDmaChSetInitialTd(uint8 chHandle, uint8 startTd);
+uint8 CyDmaChEnable(uint8 chHandle, uint8 preserveTds);
+
+#endif /* HOST_PROJECT_H */
@@ -0,0 +1,217 @@
+/*******************************************************************************
+* File Name: psoc_stub.c
+*
+* Description:
+*  Simulated PSoC components for the host build of main.c. Writes land in
+*  the sim structure and reads come from it; see host_sim.h.
+*
+*******************************************************************************/
+#include <string.h>
+#include "host_sim.h"
+
+HostSim sim;
+DWT_Type simDwt;
+CoreDebug_Type simCoreDebug;
+DWT_Type *DWT = &simDwt;
+CoreDebug_Type *CoreDebug = &simCoreDebug;
+
+void simReset(void) {
+    memset(&sim, 0, sizeof(sim));
+    sim.configured = 1u;
+    sim.configChanged = 1u;
+    sim.busActive = 1u;
+    sim.switches = 0xFFu;
+    sim.masterPot = 0xFFu;
+}
+
+void simQueueMidi(uint8 cable, uint8 status, uint8 data1, uint8 data2) {
+    SimMidiEvent *event = &sim.outQueue[sim.outHead % SIM_MIDI_QUEUE_SIZE];
+    event->cable = cable;
+    event->msg[0] = status;
+    event->msg[1] = data1;
+    event->msg[2] = data2;
+    sim.outHead++;
+}
+
+void simAdvanceCycles(uint32 cycles) {
+    simDwt.CYCCNT += cycles;
+}
+
+/* Runs pending interrupts unless PRIMASK masks them */
+static void runPendingIsrs(void) {
+    while (!sim.primask && (sim.dpPending || sim.sleepPending)) {
+        if (sim.dpPending) {
+            sim.dpPending = 0u;
+            USB_DP_ISR_ExitCallback();
+        } else {
+            sim.sleepPending = 0u;
+            if (sim.sleepIsr != NULL) {
+                sim.sleepIsr();
+            }
+        }
+    }
+}
+
+void simRaiseDp(void) {
+    sim.dpPending = 1u;
+    runPendingIsrs();
+}
+
+void simRaiseSleepTick(void) {
+    sim.sleepPending = 1u;
+    runPendingIsrs();
+}
+
+/* Like the Cortex-M3, a pending interrupt ends WFI even when PRIMASK is set */
+void __WFI(void) {
+    sim.wfiCalls++;
+    if (sim.raiseDpBeforeWfi) {
+        /* Resume signaled just before WFI. Unmasked, the ISR runs first and
+         * WFI then waits for the next interrupt. */
+        sim.raiseDpBeforeWfi = 0u;
+        sim.dpPending = 1u;
+        runPendingIsrs();
+    }
+    if (!sim.dpPending && !sim.sleepPending && sim.wfi != NULL) {
+        sim.wfi();
+    }
+}
+
+uint8 CyEnterCriticalSection(void) {
+    uint8 saved = sim.primask;
+    sim.primask = 1u;
+    if (sim.raiseDpAtMask != 0u && --sim.raiseDpAtMask == 0u) {
+        sim.dpPending = 1u;
+    }
+    return saved;
+}
+
+void CyExitCriticalSection(uint8 savedIntrStatus) {
+    sim.primask = savedIntrStatus;
+    runPendingIsrs();
+}
+
+/* USBFS */
+void USB_Start(uint8 device, uint8 mode) { (void) device; (void) mode; }
+
+uint8 USB_IsConfigurationChanged(void) {
+    uint8 changed = sim.configChanged;
+    sim.configChanged = 0u;
+    return changed;
+}
+
+uint8 USB_GetConfiguration(void) { return sim.configured; }
+uint8 USB_CheckActivity(void) { return sim.busActive; }
+
+void USB_MIDI_Init(void) {
+    sim.midiInitCalls++;
+    sim.inDiscarded += sim.inPendingLen;
+    sim.inPendingLen = 0u;
+}
+
+void USB_MIDI_IN_Service(void) {
+    if (!sim.suspended && sim.inLogLen + sim.inPendingLen <= SIM_IN_LOG_SIZE) {
+        memcpy(&sim.inLog[sim.inLogLen], sim.inPending, sim.inPendingLen);
+        sim.inLogLen += sim.inPendingLen;
+        sim.inPendingLen = 0u;
+    }
+}
+
+void USB_MIDI_OUT_Service(void) {
+    /* One USB packet worth of events per call */
+    unsigned i;
+    for (i = 0u; i < 16u && !sim.suspended && sim.outTail != sim.outHead; i++) {
+        SimMidiEvent *event = &sim.outQueue[sim.outTail % SIM_MIDI_QUEUE_SIZE];
+        sim.outTail++;
+        sim.outDelivered++;
+        USB_callbackLocalMidiEvent(event->cable, event->msg);
+        simAdvanceCycles(sim.outEventCycles);
+    }
+}
+
+uint8 USB_PutUsbMidiIn(uint8 ic, const uint8 midiMsg[], uint8 cable) {
+    (void) cable;
+    sim.putUsbMidiInCalls++;
+    if (sim.putUsbMidiInBusyEvery != 0u &&
+        sim.putUsbMidiInCalls % sim.putUsbMidiInBusyEvery == 0u) {
+        return USB_TRUE;
+    }
+    if (sim.suspended || sim.inPendingLen + ic + 1u > SIM_IN_PENDING_SIZE) {
+        return USB_TRUE;
+    }
+    /* The component appends End of SysEx */
+    memcpy(&sim.inPending[sim.inPendingLen], midiMsg, ic);
+    sim.inPendingLen += ic;
+    if (midiMsg[0] == 0xF0u) {
+        sim.inPending[sim.inPendingLen++] = 0xF7u;
+    }
+    return USB_FALSE;
+}
+
+void USB_Suspend(void) { sim.suspended = 1u; }
+void USB_Resume(void) { sim.suspended = 0u; }
+
+/* Sleep timer */
+void Sleep_isr_StartEx(cyisraddress address) { sim.sleepIsr = address; }
+void SleepTimer_Start(void) {}
+void SleepTimer_Stop(void) {}
+uint8 SleepTimer_GetStatus(void) { return 0u; }
+
+/* Lights and control panel */
+void BRIGHTNESS_RAMP_Start(void) {}
+void TRIANGLE_SEL_Start(void) {}
+void RAMP_COMP_Start(void) {}
+void LEDs_Out_1_Start(void) {}
+void Lights_Out_1_Start(void) {}
+void Lights_Out_1_Poll(void) {}
+void LIGHT_BRIGHTNESS_1_Write(uint8 value) { sim.lights[0] = value; }
+void LIGHT_BRIGHTNESS_2_Write(uint8 value) { sim.lights[1] = value; }
+void LIGHT_BRIGHTNESS_3_Write(uint8 value) { sim.lights[2] = value; }
+void LIGHT_BRIGHTNESS_4_Write(uint8 value) { sim.lights[3] = value; }
+void LIGHT_BRIGHTNESS_5_Write(uint8 value) { sim.lights[4] = value; }
+void LIGHT_BRIGHTNESS_6_Write(uint8 value) { sim.lights[5] = value; }
+void LIGHT_BRIGHTNESS_7_Write(uint8 value) { sim.lights[6] = value; }
+void SLED_STATE_SEL_Write(uint8 value) { sim.sledMode = value; }
+void HOT_LEDS_Write(uint8 value) { sim.hotLeds = value; }
+
+/* Crossfade */
+uint8 CROSSFADE_VAL_Read(void) { return sim.crossfadeVal; }
+void CROSSFADE_CTRL_Write(uint8 value) { (void) value; }
+void Crossfade_Clock_SetDividerRegister(uint16 clkDivider, uint8 restart) {
+    (void) clkDivider;
+    (void) restart;
+}
+
+/* Preset switches, SW8 enables preset 0 */
+uint8 SW1_Read(void) { return (sim.switches >> 7) & 1u; }
+uint8 SW2_Read(void) { return (sim.switches >> 6) & 1u; }
+uint8 SW3_Read(void) { return (sim.switches >> 5) & 1u; }
+uint8 SW4_Read(void) { return (sim.switches >> 4) & 1u; }
+uint8 SW5_Read(void) { return (sim.switches >> 3) & 1u; }
+uint8 SW6_Read(void) { return (sim.switches >> 2) & 1u; }
+uint8 SW7_Read(void) { return (sim.switches >> 1) & 1u; }
+uint8 SW8_Read(void) { return sim.switches & 1u; }
+
+/* Potentiometers */
+void POT_VALUE_Start(void) {}
+void POT_VALUE_StartConvert(void) {}
+
+uint8 POT_VALUE_IsEndConversion(uint8 retMode) {
+    uint8 ready = sim.potReady;
+    (void) retMode;
+    sim.potReady = 0u;
+    return ready;
+}
+
+uint8 POT_VALUE_GetResult8(void) { return sim.potValue; }
+void MASTER_POT_Start(void) {}
+void MASTER_POT_StartConvert(void) {}
+
+uint8 MASTER_POT_IsEndConversion(uint8 retMode) {
+    uint8 ready = sim.masterReady;
+    (void) retMode;
+    sim.masterReady = 0u;
+    return ready;
+}
+
+uint8 MASTER_POT_GetResult8(void) { return sim.masterPot; }
@@ -0,0 +1,61 @@
+/*******************************************************************************
+* File Name: sim_session.c
+*
+* Description:
+*  Scaffolding shared by the host simulations, see sim_session.h.
+*
+*******************************************************************************/
+#include <stdio.h>
+#include "sim_session.h"
+
+#define MAX_DUMP_PASSES         (100000u)
+
+const uint8 lightKeys[FW_NUM_LIGHTS] = {53u, 55u, 57u, 59u, 60u, 62u, 64u};
+
+unsigned long long simPasses = 0u;
+void (*simPassAdvance)(uint32 cycles) = simAdvanceCycles;
+
+static unsigned failures = 0u;
+
+void check(int condition, const char *what) {
+    if (!condition) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+int checkResult(void) {
+    printf("%s\n", failures == 0u ? "PASS" : "FAILED");
+    return failures == 0u ? 0 : 1;
+}
+
+void runPasses(unsigned passes) {
+    unsigned i;
+    for (i = 0u; i < passes; i++) {
+        simPassAdvance(SIM_CYCLES_PER_PASS);
+        simPasses++;
+        serviceMainLoop();
+    }
+}
+
+size_t requestDump(void) {
+    size_t start = sim.inLogLen;
+    simQueueMidi(0u, 0xF0u, 0x7Du, 0x01u);
+    simQueueMidi(0u, 0xF7u, 0x00u, 0x00u);
+    runPasses(1u);
+    return start;
+}
+
+int finishDump(void) {
+    unsigned passes;
+    for (passes = 0u; passes < MAX_DUMP_PASSES && traceDumping; passes++) {
+        runPasses(1u);
+    }
+    runPasses(1u);
+    return !traceDumping;
+}
+
+int decodeDump(size_t offset, uint8 *raw, size_t rawSize, TraceDump *dump) {
+    long rawLen = traceUnpackSysex(&sim.inLog[offset], sim.inLogLen - offset, raw, rawSize);
+    return rawLen >= 0 && traceParseDump(raw, (size_t) rawLen, dump) == 0;
+}
@@ -0,0 +1,57 @@
+/*******************************************************************************
+* File Name: sim_session.h
+*
+* Description:
+*  Scaffolding shared by the host simulations: the notes the firmware acts
+*  on, checks and the PASS/FAILED result, main loop passes, and requesting
+*  and decoding a trace dump over SysEx. Each simulation keeps only its
+*  scenario.
+*
+*******************************************************************************/
+#if !defined(SIM_SESSION_H)
+#define SIM_SESSION_H
+
+#include "host_sim.h"
+#include "trace_format.h"
+
+#define SIM_CYCLES_PER_PASS     (2400u)     /* 100 us at 24 MHz */
+
+#define NOTE_ON                 (0x90u)
+#define NOTE_OFF                (0x80u)
+#define POLY_PRESSURE           (0xA0u)
+#define PRESET_BUTTON           (44u)
+#define CURVE_BUTTON            (45u)
+#define AFTERTOUCH_BUTTON       (46u)
+#define PLAY_PAUSE_BUTTON       (48u)
+#define PROGRAM_BUTTON          (49u)
+#define PREV_PRESET_BUTTON      (50u)
+#define NEXT_PRESET_BUTTON      (51u)
+/* Below the keys the firmware acts on, so only the trace sees it */
+#define SPARE_NOTE              (20u)
+
+extern const uint8 lightKeys[FW_NUM_LIGHTS];
+
+/* Main loop passes run so far */
+extern unsigned long long simPasses;
+/* Lets time pass before each main loop pass. simAdvanceCycles unless the
+ * simulation raises interrupts on the way. */
+extern void (*simPassAdvance)(uint32 cycles);
+
+/* Counts a failure and prints what failed if condition is false */
+void check(int condition, const char *what);
+/* Prints PASS or FAILED, and returns the exit status for main */
+int checkResult(void);
+
+void runPasses(unsigned passes);
+
+/* Sends the dump request F0 7D 01 F7 and runs a pass. Returns the offset in
+ * sim.inLog the dump starts after. */
+size_t requestDump(void);
+/* Runs until the dump has been sent and the last chunk has left the
+ * endpoint. Returns 0 if it didn't finish. */
+int finishDump(void);
+/* Decodes the last complete dump sent after offset. Returns 0 if there is
+ * none. */
+int decodeDump(size_t offset, uint8 *raw, size_t rawSize, TraceDump *dump);
+
+#endif /* SIM_SESSION_H */
@@ -0,0 +1,234 @@
+/*******************************************************************************
+* File Name: suspend_sim.c
+*
+* Description:
+*  Scripted USB suspend and resume against the host build of main.c. The
+*  simulated clock raises the SleepTimer interrupt every 4 ms and the Dp
+*  interrupt when the host resumes the bus; WFI lets time pass until one of
+*  them. Checks that:
+*   - the lights keep following a crossfade while USB is suspended,
+*   - the main loop resumes USB within a pass of the resume signal, also
+*     when the Dp interrupt arrives while interrupts are masked,
+*   - every MIDI event the host sends around a suspend reaches the
+*     firmware exactly once, in order,
+*   - a dump cut off by the suspend is restarted and completes, and the
+*     wake counters appear in its header.
+*
+*******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include "sim_session.h"
+
+#define SLEEP_TICK_CYCLES       (BCLK__BUS_CLK__HZ / 250u)  /* 4 ms */
+#define NO_RESUME               (~0ull)
+#define MAX_NOTES               (256u)
+
+static unsigned long long cycles = 0u;
+static unsigned long long nextSleepTick = SLEEP_TICK_CYCLES;
+static unsigned long long resumeAt = NO_RESUME;
+
+static uint8 sentNotes[MAX_NOTES];
+static unsigned numSentNotes = 0u;
+
+/* Lets time pass, raising the interrupts that fall due on the way */
+static void advanceTo(unsigned long long target) {
+    for (;;) {
+        unsigned long long next = nextSleepTick < resumeAt ? nextSleepTick : resumeAt;
+        if (next > target) {
+            break;
+        }
+        simAdvanceCycles((uint32) (next - cycles));
+        cycles = next;
+        if (next == resumeAt) {
+            resumeAt = NO_RESUME;
+            simRaiseDp();
+        }
+        if (next == nextSleepTick) {
+            nextSleepTick += SLEEP_TICK_CYCLES;
+            simRaiseSleepTick();
+        }
+    }
+    simAdvanceCycles((uint32) (target - cycles));
+    cycles = target;
+}
+
+/* WFI: sleep until the next interrupt */
+static void wfi(void) {
+    advanceTo(nextSleepTick < resumeAt ? nextSleepTick : resumeAt);
+}
+
+static void advanceBy(uint32 passCycles) {
+    advanceTo(cycles + passCycles);
+}
+
+static void sendNote(void) {
+    uint8 note = (uint8) (SPARE_NOTE + numSentNotes % 8u);
+    uint8 velocity = (uint8) (1u + numSentNotes % 127u);
+    simQueueMidi(0u, NOTE_ON, note, velocity);
+    sentNotes[numSentNotes++] = velocity;
+}
+
+/* The host stops SOFs and IN polling; returns once the firmware suspended */
+static int hostSuspend(void) {
+    unsigned passes;
+    sim.busActive = 0u;
+    sim.putUsbMidiInBusyEvery = 1u;
+    for (passes = 0u; passes < 1000u && !usbSuspended; passes++) {
+        runPasses(1u);
+    }
+    return usbSuspended;
+}
+
+static void hostResume(unsigned long long delayCycles) {
+    sim.busActive = 1u;
+    sim.putUsbMidiInBusyEvery = 0u;
+    resumeAt = cycles + delayCycles;
+}
+
+static int runUntilResumed(void) {
+    unsigned passes;
+    for (passes = 0u; passes < 1000u && usbSuspended; passes++) {
+        runPasses(1u);
+    }
+    return !usbSuspended;
+}
+
+static unsigned countDumpStarts(size_t from) {
+    unsigned starts = 0u;
+    size_t i;
+    for (i = from; i + 3u < sim.inLogLen; i++) {
+        if (sim.inLog[i] == 0xF0u && sim.inLog[i + 1u] == 0x7Du &&
+            sim.inLog[i + 2u] == TRACE_SYSEX_DUMP_DATA && sim.inLog[i + 3u] == 0u) {
+            starts++;
+        }
+    }
+    return starts;
+}
+
+int main(void) {
+    static uint8 raw[1u << 17];
+    TraceDump dump;
+    TraceReader reader;
+    TraceRecord record;
+    size_t dumpStart;
+    int decoded;
+    unsigned suspendedPasses = 0u;
+    unsigned lightChanges = 0u;
+    unsigned wfiCalls;
+    unsigned received = 0u;
+    unsigned inOrder = 1u;
+    uint32 worstRaceWake = 0u;
+    uint8 lastLight;
+    unsigned i;
+    unsigned n;
+
+    simReset();
+    sim.wfi = wfi;
+    simPassAdvance = advanceBy;
+    runPasses(50u);
+    for (i = 0u; i < 20u; i++) {
+        sendNote();
+    }
+    runPasses(10u);
+
+    /* Start a crossfade that carries on while suspended */
+    simQueueMidi(0u, NOTE_ON, PLAY_PAUSE_BUTTON, 100u);
+    sim.crossfadeVal = 0u;
+    runPasses(10u);
+
+    /* Request a dump and suspend before it completes */
+    dumpStart = requestDump();
+    check(traceDumping, "dump started");
+    check(hostSuspend(), "firmware suspends when the bus goes idle");
+    check(traceDumping, "suspend came in the middle of the dump");
+
+    /* Suspended for half a second: the crossfade runs and the host queues
+     * MIDI for after the resume */
+    for (i = 0u; i < 20u; i++) {
+        sendNote();
+    }
+    wfiCalls = sim.wfiCalls;
+    lastLight = sim.lights[0];
+    while (suspendedPasses < 125u) {
+        sim.crossfadeVal = (uint8) (suspendedPasses * 2u);
+        runPasses(1u);
+        suspendedPasses++;
+        if (sim.lights[0] != lastLight) {
+            lightChanges++;
+            lastLight = sim.lights[0];
+        }
+    }
+    check(usbSuspended, "still suspended");
+    check(sim.wfiCalls - wfiCalls >= suspendedPasses - 1u, "main loop idles in WFI while suspended");
+    check(lightChanges >= 20u, "lights follow the crossfade while suspended");
+    printf("suspended: %u passes, %u light changes\n", suspendedPasses, lightChanges);
+
+    /* Resume between two SleepTimer ticks */
+    hostResume(SLEEP_TICK_CYCLES / 3u);
+    check(runUntilResumed(), "firmware resumes");
+    printf("wake: %lu cycles (%.1f us)\n", (unsigned long) usbWakeCycles,
+           usbWakeCycles * 1e6 / BCLK__BUS_CLK__HZ);
+    check(usbWakeCycles <= 2u * SIM_CYCLES_PER_PASS, "USB resumes within a pass of the resume signal");
+
+    check(finishDump(), "interrupted dump completes after the resume");
+    check(countDumpStarts(dumpStart) >= 2u, "interrupted dump was restarted");
+    check(traceUnpackSysex(&sim.inLog[dumpStart], sim.inLogLen - dumpStart, raw, sizeof(raw)) > 0,
+          "restarted dump decodes");
+
+    /* A resume arriving at each point where interrupts are masked during a
+     * suspended pass, including the resume check before WFI */
+    for (n = 1u; n <= 12u; n++) {
+        check(hostSuspend(), "suspends again");
+        runPasses(3u);
+        sim.busActive = 1u;
+        sim.putUsbMidiInBusyEvery = 0u;
+        sim.raiseDpAtMask = n;
+        check(runUntilResumed(), "resumes after a masked Dp interrupt");
+        if (usbWakeCycles > worstRaceWake) {
+            worstRaceWake = usbWakeCycles;
+        }
+        sendNote();
+        runPasses(5u);
+    }
+    /* And a resume just before WFI */
+    check(hostSuspend(), "suspends again");
+    runPasses(3u);
+    sim.busActive = 1u;
+    sim.putUsbMidiInBusyEvery = 0u;
+    sim.raiseDpBeforeWfi = 1u;
+    check(runUntilResumed(), "resumes after a Dp interrupt just before WFI");
+    if (usbWakeCycles > worstRaceWake) {
+        worstRaceWake = usbWakeCycles;
+    }
+    sendNote();
+    runPasses(5u);
+    printf("masked resume: worst wake %lu cycles\n", (unsigned long) worstRaceWake);
+    check(worstRaceWake <= 2u * SIM_CYCLES_PER_PASS, "a masked resume doesn't wait for the next tick");
+
+    /* Every note reached the firmware once, in order */
+    runPasses(10u);
+    dumpStart = requestDump();
+    check(finishDump(), "final dump completes");
+    decoded = decodeDump(dumpStart, raw, sizeof(raw), &dump);
+    check(decoded, "final dump decodes");
+    if (decoded) {
+        check(dump.dropped == 0u, "final dump holds the whole session");
+        check(dump.numCounters > 3u && dump.counters[3] == usbWakeMaxCycles,
+              "dump header carries the worst USB wake");
+        traceReaderInit(&reader, &dump);
+        while (traceNextRecord(&reader, &record) > 0) {
+            if (record.type == TRACE_TAG_MIDI && record.midi[0] == NOTE_ON &&
+                record.midi[1] >= SPARE_NOTE && record.midi[1] < SPARE_NOTE + 8u) {
+                if (received >= numSentNotes || record.midi[2] != sentNotes[received]) {
+                    inOrder = 0u;
+                }
+                received++;
+            }
+        }
+    }
+    printf("MIDI: %u notes sent, %u received\n", numSentNotes, received);
+    check(received == numSentNotes && inOrder, "every note received once, in order");
+    check(sim.outDelivered == sim.outHead, "host queue drained");
+
+    return checkResult();
+}
@@ -0,0 +1,114 @@
+/*******************************************************************************
+* File Name: trace_decode.c
+*
+* Description:
+*  Prints a trace dump captured from the controller. The input file holds
+*  the raw MIDI bytes received after sending the dump request F0 7D 01 F7,
+*  for example:
+*
+*   amidi -p hw:1 -S 'F0 7D 01 F7' -r dump.syx -t 5
+*   trace_decode dump.syx
+*
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include "trace_format.h"
+
+static const char *const inputNames[] = {"crossfade", "pot divider", "master", "switches"};
+
+static void printFrame(const TraceRecord *record) {
+    unsigned i;
+    if (!record->frameKnown) {
+        /* After a gap, until the next state record */
+        printf(" unknown, changed mask %02X", record->mask);
+        return;
+    }
+    printf(" sled %u lights", record->sledMode);
+    for (i = 0u; i < TRACE_NUM_LIGHTS; i++) {
+        printf(" %3u", record->frame[i]);
+    }
+    printf(" hot %02X", record->frame[TRACE_FRAME_SIZE - 1u]);
+}
+
+int main(int argc, char **argv) {
+    static uint8_t midi[1u << 22];
+    static uint8_t raw[1u << 17];
+    TraceDump dump;
+    TraceReader reader;
+    TraceRecord record;
+    FILE *file;
+    size_t midiLen;
+    long rawLen;
+    unsigned i;
+    int result;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s dump.syx\n", argv[0]);
+        return 2;
+    }
+    file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 2;
+    }
+    midiLen = fread(midi, 1u, sizeof(midi), file);
+    fclose(file);
+
+    rawLen = traceUnpackSysex(midi, midiLen, raw, sizeof(raw));
+    if (rawLen < 0 || traceParseDump(raw, (size_t) rawLen, &dump) != 0) {
+        fprintf(stderr, "%s: no complete trace dump found\n", argv[1]);
+        return 1;
+    }
+
+    printf("format %u, %u record bytes, %u records dropped\n",
+           dump.version, dump.recordBytes, dump.dropped);
+    if (dump.baseSledMode == TRACE_BASE_UNKNOWN) {
+        printf("base frame unknown, frames decode from the first state record\n");
+    }
+    for (i = 0u; i < dump.numCounters; i++) {
+        const char *name = traceCounterName(i);
+        printf("counter %u (%s): %lu\n", i, name != NULL ? name : "unknown",
+               (unsigned long) dump.counters[i]);
+    }
+
+    traceReaderInit(&reader, &dump);
+    while ((result = traceNextRecord(&reader, &record)) > 0) {
+        printf("%10.1f ms  ", record.time * TRACE_TICK_US / 1000.0);
+        switch (record.type) {
+            case TRACE_TAG_FRAME:
+                printf("frame");
+                printFrame(&record);
+                break;
+            case TRACE_TAG_IDLE:
+                printf("idle  x%lu", (unsigned long) record.count);
+                break;
+            case TRACE_TAG_MIDI:
+                printf("midi  cable %u: %02X %02X %02X", record.sub,
+                       record.midi[0], record.midi[1], record.midi[2]);
+                break;
+            case TRACE_TAG_INPUT:
+                printf("input %s = %u",
+                       record.sub < 4u ? inputNames[record.sub] : "unknown", record.value);
+                break;
+            case TRACE_TAG_AFTERTOUCH:
+                printf("aftertouch key %u level %u", record.sub, record.value);
+                break;
+            case TRACE_TAG_GAP:
+                printf("gap   %lu records lost", (unsigned long) record.count);
+                break;
+            case TRACE_TAG_STATE:
+                printf("state mode %u preset %u playback %u",
+                       record.state.mode, record.state.preset, record.state.playbackPreset);
+                printFrame(&record);
+                break;
+            default:
+                break;
+        }
+        printf("\n");
+    }
+    if (result < 0) {
+        fprintf(stderr, "malformed record at byte %lu\n", (unsigned long) reader.pos);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,269 @@
+/*******************************************************************************
+* File Name: trace_format.c
+*
+* Description:
+*  Decoder for the trace dump sent by the firmware over SysEx.
+*
+*******************************************************************************/
+#include <string.h>
+#include "trace_format.h"
+
+#define SYSEX_START             (0xF0u)
+#define SYSEX_END               (0xF7u)
+#define SYSEX_MANUFACTURER_ID   (0x7Du)
+#define DUMP_HEADER_FIXED_SIZE  (15u)
+#define STATE_SIZE              (13u + TRACE_FRAME_SIZE + TRACE_NUM_PRESETS * TRACE_NUM_LIGHTS)
+
+static const char *const counterNames[] = {
+    "frame record cycles",
+    "frame record max cycles",
+    "USB wake cycles",
+    "USB wake max cycles",
+    "preset programming cycles",
+    "preset programming max cycles",
+    "poly aftertouch messages",
+    "poly aftertouch levels raised",
+    "DMX frames sent",
+};
+
+const char *traceCounterName(unsigned index) {
+    if (index < sizeof(counterNames) / sizeof(counterNames[0])) {
+        return counterNames[index];
+    }
+    return NULL;
+}
+
+/* Unpacks 7-bit groups: a byte of top bits, then up to seven low parts */
+static size_t unpackChunk(const uint8_t *packed, size_t len, uint8_t *out) {
+    size_t outLen = 0u;
+    size_t i = 0u;
+    while (i < len) {
+        uint8_t top = packed[i++];
+        unsigned k;
+        for (k = 0u; k < 7u && i < len; k++) {
+            out[outLen++] = packed[i++] | (((top >> k) & 1u) << 7);
+        }
+    }
+    return outLen;
+}
+
+long traceUnpackSysex(const uint8_t *midi, size_t len, uint8_t *out, size_t outSize) {
+    long complete = -1;
+    size_t outLen = 0u;
+    unsigned nextChunk = 0u;
+    int inDump = 0;
+    size_t i = 0u;
+
+    while (i < len) {
+        size_t end;
+        if (midi[i] != SYSEX_START) {
+            i++;
+            continue;
+        }
+        for (end = i + 1u; end < len && midi[end] != SYSEX_END; end++) {
+        }
+        if (end >= len) {
+            break;
+        }
+        /* F0 7D <command> <chunk index> <data> F7 */
+        if (end - i >= 4u && midi[i + 1u] == SYSEX_MANUFACTURER_ID &&
+            (midi[i + 2u] == TRACE_SYSEX_DUMP_DATA || midi[i + 2u] == TRACE_SYSEX_DUMP_END)) {
+            unsigned chunk = midi[i + 3u];
+            uint8_t raw[64];
+            size_t rawLen;
+
+            if (chunk == 0u && !(inDump && (nextChunk & 0x7Fu) == 0u)) {
+                /* A new dump, possibly restarted after a USB suspend. The
+                 * index wraps at 128, so chunk 0 may also continue one. */
+                outLen = 0u;
+                nextChunk = 0u;
+                inDump = 1;
+            }
+            if (inDump && chunk == (nextChunk & 0x7Fu) && end - i - 4u <= 37u) {
+                rawLen = unpackChunk(&midi[i + 4u], end - i - 4u, raw);
+                if (outLen + rawLen <= outSize) {
+                    memcpy(&out[outLen], raw, rawLen);
+                    outLen += rawLen;
+                    nextChunk++;
+                    if (midi[i + 2u] == TRACE_SYSEX_DUMP_END) {
+                        complete = (long) outLen;
+                        inDump = 0;
+                    }
+                } else {
+                    inDump = 0;
+                }
+            } else {
+                inDump = 0;
+            }
+        }
+        i = end + 1u;
+    }
+    return complete;
+}
+
+static uint32_t readLe32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+int traceParseDump(const uint8_t *raw, size_t len, TraceDump *dump) {
+    size_t headerLen;
+    unsigned i;
+
+    if (len < DUMP_HEADER_FIXED_SIZE || raw[0] != TRACE_FORMAT_VERSION) {
+        return -1;
+    }
+    memset(dump, 0, sizeof(*dump));
+    dump->version = raw[0];
+    dump->recordBytes = raw[1] | (raw[2] << 8);
+    dump->dropped = raw[3] | (raw[4] << 8);
+    dump->baseSledMode = raw[5];
+    memcpy(dump->baseFrame, &raw[6], TRACE_FRAME_SIZE);
+    dump->numCounters = raw[14];
+    headerLen = DUMP_HEADER_FIXED_SIZE + 4u * dump->numCounters;
+    if (dump->numCounters > TRACE_MAX_COUNTERS || len != headerLen + dump->recordBytes) {
+        return -1;
+    }
+    for (i = 0u; i < dump->numCounters; i++) {
+        dump->counters[i] = readLe32(&raw[DUMP_HEADER_FIXED_SIZE + 4u * i]);
+    }
+    dump->records = &raw[headerLen];
+    return 0;
+}
+
+void traceReaderInit(TraceReader *reader, const TraceDump *dump) {
+    memset(reader, 0, sizeof(*reader));
+    reader->dump = dump;
+    reader->sledMode = dump->baseSledMode;
+    memcpy(reader->frame, dump->baseFrame, TRACE_FRAME_SIZE);
+    reader->frameKnown = dump->baseSledMode != TRACE_BASE_UNKNOWN;
+}
+
+static int readByte(TraceReader *reader, uint8_t *value) {
+    if (reader->pos >= reader->dump->recordBytes) {
+        return -1;
+    }
+    *value = reader->dump->records[reader->pos++];
+    return 0;
+}
+
+static int readVarint(TraceReader *reader, uint32_t *value) {
+    unsigned shift = 0u;
+    uint8_t byte;
+    *value = 0u;
+    do {
+        if (shift > 28u || readByte(reader, &byte) != 0) {
+            return -1;
+        }
+        *value |= (uint32_t) (byte & 0x7Fu) << shift;
+        shift += 7u;
+    } while (byte & 0x80u);
+    return 0;
+}
+
+static void parseState(const uint8_t *p, TraceState *state) {
+    unsigned i;
+    state->mode = p[0];
+    state->preset = p[1];
+    state->playbackPreset = p[2];
+    state->lastPreset = p[3];
+    state->crossfading = p[4];
+    state->hotLeds = p[5];
+    state->responseCurve = p[6];
+    state->masterLevel = p[7];
+    state->crossfadeVal = p[8];
+    state->switches = p[9];
+    state->sledMode = p[10];
+    state->aftertouchEnabled = p[11];
+    state->settingsShown = p[12];
+    memcpy(state->frame, &p[13], TRACE_FRAME_SIZE);
+    for (i = 0u; i < TRACE_NUM_PRESETS; i++) {
+        memcpy(state->brightnesses[i], &p[13u + TRACE_FRAME_SIZE + i * TRACE_NUM_LIGHTS], TRACE_NUM_LIGHTS);
+    }
+}
+
+int traceNextRecord(TraceReader *reader, TraceRecord *record) {
+    uint8_t tag;
+    uint8_t byte;
+    unsigned i;
+
+    if (reader->pos >= reader->dump->recordBytes) {
+        return 0;
+    }
+    memset(record, 0, sizeof(*record));
+    if (readByte(reader, &tag) != 0 || readVarint(reader, &record->ticks) != 0) {
+        return -1;
+    }
+    record->type = tag & TRACE_TAG_MASK;
+    record->sub = tag & 0x0Fu;
+    reader->time += record->ticks;
+    record->time = reader->time;
+
+    switch (record->type) {
+        case TRACE_TAG_FRAME:
+            if (readByte(reader, &record->mask) != 0) {
+                return -1;
+            }
+            for (i = 0u; i < TRACE_FRAME_SIZE; i++) {
+                if (record->mask & (1u << i)) {
+                    if (readByte(reader, &reader->frame[i]) != 0) {
+                        return -1;
+                    }
+                }
+            }
+            reader->sledMode = record->sub & 1u;
+            break;
+        case TRACE_TAG_IDLE:
+            if (readVarint(reader, &record->count) != 0) {
+                return -1;
+            }
+            break;
+        case TRACE_TAG_GAP:
+            if (readVarint(reader, &record->count) != 0) {
+                return -1;
+            }
+            reader->frameKnown = 0;
+            break;
+        case TRACE_TAG_MIDI:
+            for (i = 0u; i < 3u; i++) {
+                if (readByte(reader, &record->midi[i]) != 0) {
+                    return -1;
+                }
+            }
+            break;
+        case TRACE_TAG_AFTERTOUCH:
+            if (readByte(reader, &byte) != 0) {
+                return -1;
+            }
+            record->value = byte;
+            break;
+        case TRACE_TAG_INPUT:
+            if (readByte(reader, &byte) != 0) {
+                return -1;
+            }
+            record->value = byte;
+            if (record->sub == TRACE_INPUT_POT_DIVIDER) {
+                if (readByte(reader, &byte) != 0) {
+                    return -1;
+                }
+                record->value |= byte << 8;
+            }
+            break;
+        case TRACE_TAG_STATE:
+            if (reader->pos + STATE_SIZE > reader->dump->recordBytes) {
+                return -1;
+            }
+            parseState(&reader->dump->records[reader->pos], &record->state);
+            reader->pos += STATE_SIZE;
+            reader->sledMode = record->state.sledMode;
+            memcpy(reader->frame, record->state.frame, TRACE_FRAME_SIZE);
+            reader->frameKnown = 1;
+            break;
+        default:
+            return -1;
+    }
+
+    record->sledMode = reader->sledMode;
+    memcpy(record->frame, reader->frame, TRACE_FRAME_SIZE);
+    record->frameKnown = reader->frameKnown;
+    return 1;
+}
@@ -0,0 +1,121 @@
+/*******************************************************************************
+* File Name: trace_format.h
+*
+* Description:
+*  Decoder for the trace dump sent by the firmware over SysEx. The record
+*  and header layout is documented in main.c under "Trace recorder",
+*  traceRecordState and traceStartDump.
+*
+*******************************************************************************/
+#if !defined(TRACE_FORMAT_H)
+#define TRACE_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_FORMAT_VERSION    (3u)
+#define TRACE_FRAME_SIZE        (8u)
+#define TRACE_NUM_LIGHTS        (7u)
+#define TRACE_NUM_PRESETS       (8u)
+#define TRACE_MAX_COUNTERS      (32u)
+#define TRACE_TICK_US           (100u)
+/* Base sled mode of a dump whose base frame is unknown */
+#define TRACE_BASE_UNKNOWN      (0xFFu)
+
+#define TRACE_TAG_MASK          (0xF0u)
+#define TRACE_TAG_FRAME         (0x10u)
+#define TRACE_TAG_IDLE          (0x20u)
+#define TRACE_TAG_MIDI          (0x30u)
+#define TRACE_TAG_INPUT         (0x40u)
+#define TRACE_TAG_GAP           (0x50u)
+#define TRACE_TAG_STATE         (0x60u)
+#define TRACE_TAG_AFTERTOUCH    (0x70u)
+
+#define TRACE_INPUT_CROSSFADE   (0u)
+#define TRACE_INPUT_POT_DIVIDER (1u)
+#define TRACE_INPUT_MASTER      (2u)
+#define TRACE_INPUT_SWITCHES    (3u)
+
+#define TRACE_SYSEX_DUMP_DATA   (0x02u)
+#define TRACE_SYSEX_DUMP_END    (0x03u)
+
+/* Controller state carried by a state record */
+typedef struct {
+    uint8_t mode;
+    uint8_t preset;
+    uint8_t playbackPreset;
+    uint8_t lastPreset;
+    uint8_t crossfading;
+    uint8_t hotLeds;
+    uint8_t responseCurve;
+    uint8_t masterLevel;
+    uint8_t crossfadeVal;
+    uint8_t switches;
+    uint8_t sledMode;
+    uint8_t aftertouchEnabled;
+    uint8_t settingsShown;
+    uint8_t frame[TRACE_FRAME_SIZE];
+    uint8_t brightnesses[TRACE_NUM_PRESETS][TRACE_NUM_LIGHTS];
+} TraceState;
+
+typedef struct {
+    uint8_t type;               /* TRACE_TAG_x */
+    uint8_t sub;                /* Low nibble of the tag */
+    uint32_t ticks;             /* Since the previous record */
+    uint64_t time;              /* Since the first record, in ticks */
+    /* TRACE_TAG_FRAME: the whole frame after applying the delta, valid
+     * if frameKnown. Also set for the other records. */
+    uint8_t mask;
+    uint8_t sledMode;
+    uint8_t frame[TRACE_FRAME_SIZE];
+    int frameKnown;
+    /* TRACE_TAG_IDLE and TRACE_TAG_GAP */
+    uint32_t count;
+    /* TRACE_TAG_MIDI */
+    uint8_t midi[3];
+    /* TRACE_TAG_INPUT, and the level of TRACE_TAG_AFTERTOUCH */
+    uint16_t value;
+    /* TRACE_TAG_STATE */
+    TraceState state;
+} TraceRecord;
+
+typedef struct {
+    uint8_t version;
+    uint16_t recordBytes;
+    uint16_t dropped;
+    uint8_t baseSledMode;
+    uint8_t baseFrame[TRACE_FRAME_SIZE];
+    uint8_t numCounters;
+    uint32_t counters[TRACE_MAX_COUNTERS];
+    const uint8_t *records;
+} TraceDump;
+
+typedef struct {
+    const TraceDump *dump;
+    size_t pos;
+    uint64_t time;
+    uint8_t sledMode;
+    uint8_t frame[TRACE_FRAME_SIZE];
+    /* Cleared by a gap record, or an unknown base frame, until the next
+     * state record */
+    int frameKnown;
+} TraceReader;
+
+/* Extracts the last complete dump from a stream of MIDI bytes (SysEx as
+ * received from the device, other messages are skipped). Returns the number
+ * of raw dump bytes written to out, or -1 if no complete dump was found. */
+long traceUnpackSysex(const uint8_t *midi, size_t len, uint8_t *out, size_t outSize);
+
+/* Parses the dump header. Returns 0 on success. */
+int traceParseDump(const uint8_t *raw, size_t len, TraceDump *dump);
+
+void traceReaderInit(TraceReader *reader, const TraceDump *dump);
+
+/* Decodes the next record. Returns 1 on success, 0 at the end and -1 if the
+ * record stream is malformed. */
+int traceNextRecord(TraceReader *reader, TraceRecord *record);
+
+/* Name of a header counter, or NULL if the decoder doesn't know it */
+const char *traceCounterName(unsigned index);
+
+#endif /* TRACE_FORMAT_H */
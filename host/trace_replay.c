@@ -0,0 +1,444 @@
+/*******************************************************************************
+* File Name: trace_replay.c
+*
+* Description:
+*  Replays a trace dump through the firmware render path and checks that it
+*  produces the recorded frames. From the first state record onwards, MIDI
+*  events are handed to USB_callbackLocalMidiEvent, recorded aftertouch
+*  levels to applyAftertouch, inputs are set on the simulated hardware, and
+*  each recorded frame is rendered and compared.
+*
+*   trace_replay dump.syx    Replays a dump captured from the controller,
+*                            to check a firmware change renders the same.
+*   trace_replay             Runs a scripted session on the host build,
+*                            dumps it over SysEx and replays the dumps.
+*
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_session.h"
+
+#define TICK_CYCLES             (BCLK__BUS_CLK__HZ / 1000000u * TRACE_TICK_US)
+
+typedef struct {
+    unsigned framesChecked;
+    unsigned framesSkipped;
+    unsigned mismatches;
+    unsigned stateMismatches;
+    unsigned states;
+    unsigned gaps;
+} ReplayResult;
+
+static void loadState(const TraceState *state) {
+    mode = state->mode;
+    preset = state->preset;
+    playback_preset = state->playbackPreset;
+    last_preset = state->lastPreset;
+    crossfading = state->crossfading;
+    hotLeds = state->hotLeds;
+    responseCurve = state->responseCurve;
+    aftertouchEnabled = state->aftertouchEnabled;
+    settingsShown = state->settingsShown;
+    setMasterLevel(state->masterLevel);
+    sim.crossfadeVal = state->crossfadeVal;
+    traceLastCrossfade = state->crossfadeVal;
+    sim.switches = state->switches;
+    traceLastSwitches = state->switches;
+    outputSledMode = state->sledMode;
+    memcpy(outputFrame, state->frame, FW_FRAME_SIZE);
+    memcpy(storedBrightnesses, state->brightnesses, sizeof(storedBrightnesses));
+}
+
+static int stateMatches(const TraceState *state) {
+    return mode == state->mode && preset == state->preset &&
+           playback_preset == state->playbackPreset && last_preset == state->lastPreset &&
+           crossfading == state->crossfading && hotLeds == state->hotLeds &&
+           responseCurve == state->responseCurve && master_level == state->masterLevel &&
+           aftertouchEnabled == state->aftertouchEnabled && settingsShown == state->settingsShown &&
+           outputSledMode == state->sledMode &&
+           memcmp(outputFrame, state->frame, FW_FRAME_SIZE) == 0 &&
+           memcmp(storedBrightnesses, state->brightnesses, sizeof(storedBrightnesses)) == 0;
+}
+
+static void renderAndCompare(const TraceRecord *record, ReplayResult *result) {
+    renderOutputFrame();
+    result->framesChecked++;
+    if (outputSledMode != record->sledMode ||
+        memcmp(outputFrame, record->frame, FW_FRAME_SIZE) != 0) {
+        if (result->mismatches < 5u) {
+            unsigned i;
+            printf("  mismatch at %.1f ms: rendered", record->time * TRACE_TICK_US / 1000.0);
+            for (i = 0u; i < FW_FRAME_SIZE; i++) {
+                printf(" %u", outputFrame[i]);
+            }
+            printf(", recorded");
+            for (i = 0u; i < FW_FRAME_SIZE; i++) {
+                printf(" %u", record->frame[i]);
+            }
+            printf("\n");
+        }
+        result->mismatches++;
+        /* Carry on from the recorded frame */
+        memcpy(outputFrame, record->frame, FW_FRAME_SIZE);
+        outputSledMode = record->sledMode;
+    }
+}
+
+static int replay(const TraceDump *dump, ReplayResult *result) {
+    TraceReader reader;
+    TraceRecord record;
+    int synced = 0;
+    int status;
+    uint32 i;
+
+    memset(result, 0, sizeof(*result));
+    traceReaderInit(&reader, dump);
+    while ((status = traceNextRecord(&reader, &record)) > 0) {
+        switch (record.type) {
+            case TRACE_TAG_STATE:
+                result->states++;
+                if (synced && !stateMatches(&record.state)) {
+                    result->stateMismatches++;
+                }
+                loadState(&record.state);
+                synced = 1;
+                break;
+            case TRACE_TAG_GAP:
+                result->gaps++;
+                synced = 0;
+                break;
+            case TRACE_TAG_MIDI:
+                if (synced) {
+                    USB_callbackLocalMidiEvent(record.sub, record.midi);
+                }
+                break;
+            case TRACE_TAG_AFTERTOUCH:
+                if (synced) {
+                    applyAftertouch(record.sub, (uint8) record.value);
+                }
+                break;
+            case TRACE_TAG_INPUT:
+                if (record.sub == TRACE_INPUT_CROSSFADE) {
+                    sim.crossfadeVal = (uint8) record.value;
+                } else if (record.sub == TRACE_INPUT_SWITCHES) {
+                    sim.switches = (uint8) record.value;
+                } else if (record.sub == TRACE_INPUT_MASTER && synced) {
+                    setMasterLevel((uint8) record.value);
+                }
+                break;
+            case TRACE_TAG_FRAME:
+                if (synced) {
+                    renderAndCompare(&record, result);
+                } else {
+                    result->framesSkipped++;
+                }
+                break;
+            case TRACE_TAG_IDLE:
+                for (i = 0u; i < record.count; i++) {
+                    if (synced) {
+                        renderAndCompare(&record, result);
+                    } else {
+                        result->framesSkipped++;
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return status;
+}
+
+static void printResult(const char *name, const TraceDump *dump, const ReplayResult *result) {
+    printf("%s: %u record bytes, %u dropped, %u states, %u gaps, "
+           "%u frames replayed (%u before a state), %u frame and %u state mismatches\n",
+           name, dump->recordBytes, dump->dropped, result->states, result->gaps,
+           result->framesChecked, result->framesSkipped, result->mismatches,
+           result->stateMismatches);
+}
+
+static int replayFile(const char *path) {
+    static uint8 midi[1u << 22];
+    static uint8 raw[1u << 17];
+    TraceDump dump;
+    ReplayResult result;
+    FILE *file = fopen(path, "rb");
+    size_t midiLen;
+    long rawLen;
+
+    if (file == NULL) {
+        perror(path);
+        return 2;
+    }
+    midiLen = fread(midi, 1u, sizeof(midi), file);
+    fclose(file);
+
+    simReset();
+    rawLen = traceUnpackSysex(midi, midiLen, raw, sizeof(raw));
+    if (rawLen < 0 || traceParseDump(raw, (size_t) rawLen, &dump) != 0) {
+        fprintf(stderr, "%s: no complete trace dump found\n", path);
+        return 1;
+    }
+    if (replay(&dump, &result) < 0) {
+        fprintf(stderr, "%s: malformed record\n", path);
+        return 1;
+    }
+    printResult(path, &dump, &result);
+    return (result.mismatches == 0u && result.stateMismatches == 0u) ? 0 : 1;
+}
+
+/*******************************************************************************
+* Scripted session
+*******************************************************************************/
+static void pressKey(uint8 note, uint8 velocity) {
+    simQueueMidi(0u, NOTE_ON, note, velocity);
+    runPasses(20u);
+    simQueueMidi(0u, NOTE_OFF, note, 0u);
+    runPasses(20u);
+}
+
+/* Presses a key harder and then eases off, one pressure message a ms */
+static void holdWithPressure(uint8 note, uint8 velocity) {
+    unsigned pressure;
+
+    simQueueMidi(0u, NOTE_ON, note, velocity);
+    runPasses(10u);
+    for (pressure = 0u; pressure <= 120u; pressure += 4u) {
+        simQueueMidi(0u, POLY_PRESSURE, note, (uint8) pressure);
+        runPasses(10u);
+    }
+    for (pressure = 120u; pressure > 0u; pressure -= 8u) {
+        simQueueMidi(0u, POLY_PRESSURE, note, (uint8) pressure);
+        runPasses(10u);
+    }
+    simQueueMidi(0u, NOTE_OFF, note, 0u);
+    runPasses(10u);
+}
+
+/* Counts the aftertouch levels and poly pressure MIDI records in a dump */
+static void countAftertouch(const TraceDump *dump, unsigned *levels, unsigned *pressures) {
+    TraceReader reader;
+    TraceRecord record;
+
+    *levels = 0u;
+    *pressures = 0u;
+    traceReaderInit(&reader, dump);
+    while (traceNextRecord(&reader, &record) > 0) {
+        if (record.type == TRACE_TAG_AFTERTOUCH) {
+            (*levels)++;
+        } else if (record.type == TRACE_TAG_MIDI && (record.midi[0] & 0xF0u) == POLY_PRESSURE) {
+            (*pressures)++;
+        }
+    }
+}
+
+static uint32 nowTicks(void) {
+    return (uint32) (simPasses * SIM_CYCLES_PER_PASS / TICK_CYCLES);
+}
+
+/* Starts a crossfade and ramps the hardware crossfade counter through it */
+static uint32 crossfade(uint8 step) {
+    uint32 start;
+    unsigned value;
+
+    simQueueMidi(0u, NOTE_ON, PLAY_PAUSE_BUTTON, 100u);
+    sim.crossfadeVal = 0u;
+    runPasses(1u);
+    start = nowTicks();
+    simQueueMidi(0u, NOTE_OFF, PLAY_PAUSE_BUTTON, 0u);
+    for (value = 0u; value < 255u; value += step) {
+        sim.crossfadeVal = (uint8) value;
+        runPasses(2u);
+    }
+    sim.crossfadeVal = 255u;
+    runPasses(5u);
+    return start;
+}
+
+static void moveMaster(uint8 value) {
+    sim.masterPot = value;
+    sim.masterReady = 1u;
+    runPasses(3u);
+}
+
+/* Whether the frame decoded at the end of a dump is the current output, or
+ * is marked unknown */
+static int lastFrameMatches(const TraceDump *dump) {
+    TraceReader reader;
+    TraceRecord record;
+
+    traceReaderInit(&reader, dump);
+    while (traceNextRecord(&reader, &record) > 0) {
+    }
+    return !reader.frameKnown || (reader.sledMode == outputSledMode &&
+                                  memcmp(reader.frame, outputFrame, FW_FRAME_SIZE) == 0);
+}
+
+/* Time between the last PLAY_PAUSE press and the dump request, as recorded */
+static long recordedTicksToRequest(const TraceDump *dump) {
+    TraceReader reader;
+    TraceRecord record;
+    uint64_t pressTime = 0u;
+    int found = 0;
+
+    traceReaderInit(&reader, dump);
+    while (traceNextRecord(&reader, &record) > 0) {
+        if (record.type == TRACE_TAG_MIDI && record.midi[0] == NOTE_ON &&
+            record.midi[1] == PLAY_PAUSE_BUTTON) {
+            pressTime = record.time;
+            found = 1;
+        }
+        if (record.type == TRACE_TAG_MIDI && record.midi[0] == 0xF0u && record.midi[2] == 0x01u) {
+            return found ? (long) (record.time - pressTime) : -1;
+        }
+    }
+    return -1;
+}
+
+/* The replays drive the same firmware globals, so they run after the session */
+static int runSession(void) {
+    static uint8 firstRaw[1u << 17];
+    static uint8 stallRaw[1u << 17];
+    static uint8 wrapRaw[1u << 17];
+    TraceDump first;
+    TraceDump stall;
+    TraceDump wrap;
+    ReplayResult result;
+    size_t dumpStart;
+    uint32 pressTicks;
+    uint32 requestTicks;
+    long recordedTicks;
+    unsigned levels;
+    unsigned pressures;
+    int decoded;
+    int stallDecoded;
+    unsigned i;
+    unsigned k;
+
+    simReset();
+    runPasses(100u);
+
+    /* Program preset 1 from the keys */
+    simQueueMidi(0u, NOTE_ON, PROGRAM_BUTTON, 100u);
+    simQueueMidi(0u, NOTE_ON, NEXT_PRESET_BUTTON, 100u);
+    simQueueMidi(0u, NOTE_ON, PRESET_BUTTON, 100u);
+    runPasses(10u);
+    for (k = 0u; k < FW_NUM_LIGHTS; k++) {
+        pressKey(lightKeys[k], (uint8) (20u + 15u * k));
+    }
+    simQueueMidi(0u, NOTE_ON, PROGRAM_BUTTON, 100u);
+    runPasses(10u);
+
+    /* Fade around the presets with the inputs moving, enough to wrap the ring */
+    sim.switches = 0xB7u;
+    for (i = 0u; i < 24u; i++) {
+        crossfade((uint8) (1u + i % 3u));
+        moveMaster((uint8) (255u - 9u * i));
+        sim.potValue = (uint8) (40u * i);
+        sim.potReady = 1u;
+        runPasses(50u);
+    }
+
+    /* A long static scene: idle runs and a periodic state record */
+    runPasses(400000u);
+
+    /* Brighten preset 1 with aftertouch, with the settings shown on the way */
+    simQueueMidi(0u, NOTE_ON, PROGRAM_BUTTON, 100u);
+    simQueueMidi(0u, NOTE_ON, PRESET_BUTTON, 100u);
+    runPasses(10u);
+    pressKey(AFTERTOUCH_BUTTON, 100u);
+    pressKey(CURVE_BUTTON, 100u);
+    for (k = 0u; k < 3u; k++) {
+        holdWithPressure(lightKeys[k], 40u);
+    }
+    simQueueMidi(0u, NOTE_ON, PROGRAM_BUTTON, 100u);
+    runPasses(10u);
+
+    /* Dump while the show goes on; the host is slow to take chunks */
+    pressTicks = crossfade(2u);
+    moveMaster(128u);
+    dumpStart = requestDump();
+    requestTicks = nowTicks();
+    sim.putUsbMidiInBusyEvery = 3u;
+    for (i = 0u; i < 10u && traceDumping; i++) {
+        crossfade(1u);
+    }
+    finishDump();
+    decoded = decodeDump(dumpStart, firstRaw, sizeof(firstRaw), &first);
+    check(decoded, "first dump decodes");
+    if (decoded) {
+        check(first.dropped > 0u, "first dump has wrapped the ring");
+        recordedTicks = recordedTicksToRequest(&first);
+        check(recordedTicks >= 0 && labs(recordedTicks - (long) (requestTicks - pressTicks)) <= 1,
+              "record timestamps match simulated time");
+        countAftertouch(&first, &levels, &pressures);
+        check(levels > 0u && pressures == 0u, "only applied aftertouch levels are recorded");
+    }
+
+    /* Stall the host so the dump holds the ring: new records are lost */
+    sim.putUsbMidiInBusyEvery = 1u;
+    requestDump();
+    for (i = 0u; i < 12u; i++) {
+        crossfade(1u);
+    }
+    sim.putUsbMidiInBusyEvery = 0u;
+    finishDump();
+    for (i = 0u; i < 3u; i++) {
+        crossfade(2u);
+    }
+    runPasses(10u);
+
+    /* The next dump shows the loss as a gap and replays again after it */
+    dumpStart = requestDump();
+    finishDump();
+    stallDecoded = decodeDump(dumpStart, stallRaw, sizeof(stallRaw), &stall);
+    check(stallDecoded, "dump after stall decodes");
+
+    /* Lose a master level change to a stalled dump, then wrap the ring with
+     * MIDI alone past the gap and the state record after it: the next
+     * dump's base frame has to come from the dropped state record */
+    sim.putUsbMidiInBusyEvery = 1u;
+    requestDump();
+    moveMaster(40u);
+    runPasses(10u);
+    sim.putUsbMidiInBusyEvery = 0u;
+    finishDump();
+    for (i = 0u; i < 8000u; i++) {
+        simQueueMidi(0u, NOTE_ON, SPARE_NOTE, (uint8) (1u + i % 127u));
+        runPasses(1u);
+    }
+    dumpStart = requestDump();
+    finishDump();
+    check(decodeDump(dumpStart, wrapRaw, sizeof(wrapRaw), &wrap), "dump after wrapping past the gap decodes");
+    check(wrap.baseSledMode != TRACE_BASE_UNKNOWN, "base frame known again from the dropped state record");
+    check(lastFrameMatches(&wrap), "base frame after the dropped state record is the real output");
+
+    if (decoded) {
+        check(replay(&first, &result) == 0, "first dump parses");
+        printResult("first dump", &first, &result);
+        check(result.framesChecked > 1000u, "first dump replays frames");
+        check(result.mismatches == 0u && result.stateMismatches == 0u, "first dump replays exactly");
+    }
+    if (stallDecoded) {
+        check(replay(&stall, &result) == 0, "dump after stall parses");
+        printResult("dump after stall", &stall, &result);
+        check(result.gaps > 0u, "lost records are marked by a gap");
+        check(result.framesChecked > 500u, "frames after the gap replay");
+        check(result.mismatches == 0u && result.stateMismatches == 0u,
+              "dump after stall replays exactly");
+    }
+
+    return checkResult();
+}
+
+int main(int argc, char **argv) {
+    if (argc == 2) {
+        return replayFile(argv[1]);
+    }
+    if (argc != 1) {
+        fprintf(stderr, "usage: %s [dump.syx]\n", argv[0]);
+        return 2;
+    }
+    return runSession();
+}
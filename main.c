@@ -57,10 +57,157 @@
 #define PROGRAM_BUTTON          (49u)
 #define PREV_PRESET_BUTTON      (50u)
 #define NEXT_PRESET_BUTTON      (51u)
-#define UNUSED_BUTTON_1         (45u)
-#define UNUSED_BUTTON_2         (46u)
+#define CURVE_BUTTON            (45u)
+#define AFTERTOUCH_BUTTON       (46u)
 #define UNUSED_BUTTON_3         (47u)
 
+/* Velocity and aftertouch response curves */
+#define CURVE_LINEAR            (0u)
+#define CURVE_SOFT              (1u)
+#define CURVE_HARD              (2u)
+#define NUM_CURVES              (3u)
+#define MIDI_MAX_VALUE          (127u)
+
+/* Aftertouch is applied at most once per interval for each key */
+#define AFTERTOUCH_NONE         (0xFFu)
+#define AFTERTOUCH_INTERVAL_MS  (10u)
+#define AFTERTOUCH_INTERVAL_CYCLES  (BCLK__BUS_CLK__HZ / 1000u * AFTERTOUCH_INTERVAL_MS)
+
+/* Control panel LEDs showing the preset mode settings: the LED at the
+ * number of the response curve, and the last LED while aftertouch is on */
+#define SETTINGS_AFTERTOUCH_LED (0x80u)
+
+/* Output frame layout: one byte per light, then the control panel LEDs */
+#define NUM_LIGHTS              (7u)
+#define FRAME_HOT_LEDS          (7u)
+#define FRAME_SIZE              (8u)
+
+/*******************************************************************************
+* Trace recorder
+********************************************************************************
+* Every committed output frame, every MIDI event and every change of a
+* non-MIDI input is logged into a RAM ring buffer as a stream of variable
+* length records. Each record is a tag byte, whose high nibble is the record
+* type, then the number of TRACE_TICK_US ticks since the previous record as a
+* varint (7 bits per byte, low bits first, top bit set on all but the last
+* byte), then the payload:
+*
+*  TRACE_TAG_FRAME | sledMode  mask, value...  Frame that differs from the
+*                                              previous one. Bit i of mask is
+*                                              set for each changed frame
+*                                              byte i, and the new values
+*                                              follow in index order.
+*  TRACE_TAG_IDLE              count (varint)  count frames equal to the
+*                                              previous one. The ticks are
+*                                              up to the last of them.
+*  TRACE_TAG_MIDI | cable      byte0-2         MIDI event from USB.
+*  TRACE_TAG_INPUT | input     value           CROSSFADE_VAL, MASTER_POT level
+*                                              (0-63) or preset switches
+*                                              changed, one byte each; or the
+*                                              crossfade clock divider set
+*                                              from POT_VALUE, two bytes LE.
+*  TRACE_TAG_AFTERTOUCH | key  level           Aftertouch raised the level
+*                                              of a held light key. Poly
+*                                              pressure messages themselves
+*                                              aren't recorded.
+*  TRACE_TAG_GAP               count (varint)  count records were lost while
+*                                              a dump held the buffer. Frames
+*                                              can't be decoded again until
+*                                              the next state record.
+*  TRACE_TAG_STATE             TRACE_STATE_SIZE bytes, see traceRecordState.
+*
+* A state record is written before the first frame, after a gap and then
+* every TRACE_STATE_INTERVAL_TICKS, so a trace can be replayed through the
+* render path from any state record onwards.
+*
+* When the buffer is full the oldest records are dropped, and the frame they
+* described is folded into traceBaseFrame so the remaining deltas still decode.
+* Dropping a gap record makes the base frame unknown until a state record is
+* dropped, which carries the frame to base the deltas after it on.
+*******************************************************************************/
+#define TRACE_BUFFER_SIZE       (32768u)
+#define TRACE_TAG_MASK          (0xF0u)
+#define TRACE_TAG_FRAME         (0x10u)
+#define TRACE_TAG_IDLE          (0x20u)
+#define TRACE_TAG_MIDI          (0x30u)
+#define TRACE_TAG_INPUT         (0x40u)
+#define TRACE_TAG_GAP           (0x50u)
+#define TRACE_TAG_STATE         (0x60u)
+#define TRACE_TAG_AFTERTOUCH    (0x70u)
+#define TRACE_INPUT_CROSSFADE   (0u)
+#define TRACE_INPUT_POT_DIVIDER (1u)
+#define TRACE_INPUT_MASTER      (2u)
+#define TRACE_INPUT_SWITCHES    (3u)
+#define TRACE_VARINT_MAX        (5u)
+#define TRACE_RECORD_MAX        (1u + TRACE_VARINT_MAX + TRACE_STATE_SIZE)
+#define TRACE_TICK_US           (100u)
+#define TRACE_TICK_CYCLES       (BCLK__BUS_CLK__HZ / 1000000u * TRACE_TICK_US)
+#define TRACE_IDLE_MAX_TICKS    (100000u)
+#define TRACE_STATE_INTERVAL_TICKS  (300000u)
+#define TRACE_STATE_SIZE        (13u + FRAME_SIZE + 8u * NUM_LIGHTS)
+#define TRACE_STATE_SLED_MODE   (10u)
+#define TRACE_STATE_FRAME       (13u)
+#define TRACE_BASE_UNKNOWN      (0xFFu)
+#define TRACE_FORMAT_VERSION    (3u)
+
+/* Trace dump over SysEx: F0 7D <command> <chunk index> <7-bit packed data> */
+#define SYSEX_START             (0xF0u)
+#define SYSEX_MANUFACTURER_ID   (0x7Du)
+#define TRACE_SYSEX_DUMP_REQ    (0x01u)
+#define TRACE_SYSEX_DUMP_DATA   (0x02u)
+#define TRACE_SYSEX_DUMP_END    (0x03u)
+#define TRACE_SYSEX_HEADER_SIZE (4u)
+#define TRACE_CHUNK_RAW_SIZE    (28u)
+#define TRACE_CHUNK_PACKED_SIZE (32u)
+#define TRACE_NUM_COUNTERS      (9u)
+#define TRACE_DUMP_HEADER_SIZE  (15u + 4u * TRACE_NUM_COUNTERS)
+
+/*******************************************************************************
+* DMX512 output
+********************************************************************************
+* Streams the patched output frame to DMX fixtures. DMX_DMA copies the start
+* code and all 512 slots into DMX_UART (250 kbaud, 8N2) without CPU help. The
+* break and mark-after-break are made by sending one 0x00 byte with DMX_Clock
+* slowed down five times: nine low bits give a 180 us break, and the two stop
+* bits give a 40 us MAB. DMX_Timer (1 MHz, one shot) sequences the steps:
+*
+*  break byte -> DMA of 513 bytes -> UART FIFO empty -> last slot shifted out
+*  -> next break byte ...
+*
+* DMX_Clock may only be slowed for the break once the last slot has left the
+* shift register, or that slot goes out at the break rate. When DMX_DMA
+* queues the last slot up to DMX_UART_FIFO_DEPTH slots are still in the FIFO,
+* so DMX_DRAIN_US later the FIFO empty status is polled, and one slot time
+* after it reads empty the line is idle.
+*
+* A full frame is about 23 ms, so the universe refreshes at about 43 Hz.
+*
+* DMX_ENABLED is off by default. Set it to 1 in the project's preprocessor
+* definitions once DMX_UART, DMX_Clock, DMX_DMA, DMX_Timer and the
+* DMX_Done_isr and DMX_Timer_isr interrupts are placed in TopDesign.
+*******************************************************************************/
+#if !defined(DMX_ENABLED)
+    #define DMX_ENABLED         (0u)
+#endif
+#if (DMX_ENABLED) && !defined(CY_UART_DMX_UART_H)
+    #error DMX_ENABLED is set but the DMX_UART component is not in TopDesign
+#endif
+
+#define DMX_NUM_SLOTS           (512u)
+#define DMX_START_CODE          (0x00u)
+#define DMX_BREAK_DIVIDE        (5u)
+#define DMX_BREAK_US            (240u)
+#define DMX_SLOT_US             (44u)
+#define DMX_UART_FIFO_DEPTH     (4u)
+#define DMX_DRAIN_US            (DMX_UART_FIFO_DEPTH * DMX_SLOT_US)
+#define DMX_MARGIN_US           (10u)
+#define DMX_UNPATCHED           (0u)
+
+#define DMX_STATE_IDLE          (0u)
+#define DMX_STATE_BREAK         (1u)
+#define DMX_STATE_SLOTS         (2u)
+#define DMX_STATE_DRAIN         (3u)
+
 /* Identity Reply message */
 const uint8 CYCODE MIDI_IDENTITY_REPLY[] = {
     0xF0u,      /* SysEx */
@@ -81,6 +228,14 @@ volatile uint8 USB_MIDI2_InqFlags;
 
 volatile uint8 usbActivityCounter = 0u;
 
+// USB is suspended but the lights keep running, see main loop
+uint8 usbSuspended = 0u;
+volatile uint8 usbResumePending = 0u;
+// Cycles from the resume signal to USB MIDI being serviced again
+volatile uint32 usbWakeStartCycles = 0u;
+uint32 usbWakeCycles = 0u;
+uint32 usbWakeMaxCycles = 0u;
+
 uint8 inqFlagsOld = 0u;
 
 uint8 currentKeyNumber = 0u;
@@ -104,8 +259,96 @@ short crossfading = 0;
 uint8 hotLeds = 0u;
 uint16 last_divider = 20;
 uint8 last_pot_value = 0;
+uint8 master_level = 63;
 float master_brightness = 1;
 
+// Response curve used to turn velocity and pressure into a brightness
+uint8 responseCurve = CURVE_LINEAR;
+
+// Whether poly aftertouch can raise a held key's brightness in preset mode
+uint8 aftertouchEnabled = 0u;
+
+// Show the settings on the control panel while a settings button is held
+uint8 settingsShown = 0u;
+
+// Highest unapplied aftertouch pressure for each held light key, raised by
+// the USB callback, which runs from the OUT EP ISR in DMA auto mode
+volatile uint8 aftertouchPending[NUM_LIGHTS] = {
+    AFTERTOUCH_NONE, AFTERTOUCH_NONE, AFTERTOUCH_NONE, AFTERTOUCH_NONE,
+    AFTERTOUCH_NONE, AFTERTOUCH_NONE, AFTERTOUCH_NONE
+};
+uint32 aftertouchLastCycles[NUM_LIGHTS] = {0u, 0u, 0u, 0u, 0u, 0u, 0u};
+// Aftertouch events received, and how many of them raised a level
+uint32 aftertouchEvents = 0u;
+uint32 aftertouchApplied = 0u;
+
+// Cycles from a programming note-on to the frame that shows it
+uint8 programPending = 0u;
+uint32 programStartCycles = 0u;
+uint32 programLatencyCycles = 0u;
+uint32 programLatencyMaxCycles = 0u;
+
+// Output frame most recently written to the lights and control panel
+uint8 outputFrame[FRAME_SIZE] = {0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u};
+uint8 outputSledMode = SLED_MODE_ONE_HOT;
+
+#if (DMX_ENABLED)
+// DMX start code followed by the 512 slots, read directly by DMX_DMA
+uint8 dmxFrame[1u + DMX_NUM_SLOTS];
+// DMX address (1-512) each output frame byte is patched to, or DMX_UNPATCHED
+uint16 dmxPatch[FRAME_SIZE] = {1u, 2u, 3u, 4u, 5u, 6u, 7u, DMX_UNPATCHED};
+volatile uint8 dmxState = DMX_STATE_IDLE;
+volatile uint32 dmxFrameCount = 0u;
+uint8 dmxDmaChannel;
+uint8 dmxDmaTd;
+uint16 dmxSlotDivider;
+#endif
+
+// Trace ring buffer, see "Trace recorder" above
+uint8 traceBuffer[TRACE_BUFFER_SIZE];
+uint16 traceHead = 0u;
+uint16 traceTail = 0u;
+uint16 traceUsed = 0u;
+uint16 traceDropped = 0u;
+// Records that could not be written while a dump held the buffer
+uint16 traceLost = 0u;
+// Ticks not yet written to a record, and the cycle count they run up to
+uint32 tracePendingTicks = 0u;
+uint32 traceStampCycles = 0u;
+// Unchanged frames not yet written, and the ticks up to the last of them
+uint32 traceIdleFrames = 0u;
+uint32 traceIdleTicks = 0u;
+// Ticks since the last state record, or TRACE_STATE_INTERVAL_TICKS if one is due
+uint32 traceStateTicks = TRACE_STATE_INTERVAL_TICKS;
+// Frame state at the oldest record still in the buffer
+uint8 traceBaseFrame[FRAME_SIZE] = {0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u};
+uint8 traceBaseSledMode = SLED_MODE_ONE_HOT;
+// Cleared when a gap record is dropped, until a state record is dropped
+uint8 traceBaseKnown = 1u;
+// Frame state after the newest record
+uint8 traceLastFrame[FRAME_SIZE] = {0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u};
+uint8 traceLastSledMode = SLED_MODE_ONE_HOT;
+// Last recorded value of each non-MIDI input
+uint8 traceLastCrossfade = 0u;
+uint8 traceLastSwitches = 0u;
+// CPU cycles spent recording the last frame, and the worst case seen
+uint32 traceLastCycles = 0u;
+uint32 traceMaxCycles = 0u;
+
+// Trace dump in progress. Records keep being appended to free space, and
+// only records that have already been sent may be dropped to make room.
+volatile uint8 traceDumpRequested = 0u;
+uint8 traceDumping = 0u;
+uint8 traceDumpHeaderPos = 0u;
+uint16 traceDumpRead = 0u;
+uint16 traceDumpRemaining = 0u;
+uint8 traceDumpChunk = 0u;
+uint8 traceDumpHeader[TRACE_DUMP_HEADER_SIZE];
+uint8 traceSysex[TRACE_SYSEX_HEADER_SIZE + TRACE_CHUNK_PACKED_SIZE];
+
+uint8 readPresetSwitches();
+void traceRecordAftertouch(uint8 key, uint8 level);
+
 /*******************************************************************************
 * Function Name: SleepIsr
 ********************************************************************************
@@ -113,10 +356,10 @@ float master_brightness = 1;
 *  The sleep interrupt-service-routine used to determine a sleep condition.
 *  The device goes into the Suspend state when there is a constant Idle 
 *  state on its upstream-facing bus-lines for more than 3.0 ms. 
-*  The device must be suspended drawing only suspend current from the 
-*  bus after no more than 10 ms of the bus inactivity on all its ports.
-*  This ISR is run each 4 ms, so after a second turn without the USB activity,  
-*  the device should be suspended.
+*  The device must be suspended after no more than 10 ms of the bus 
+*  inactivity on all its ports. This ISR is run each 4 ms, so after a 
+*  second turn without the USB activity, the device should be suspended. 
+*  It keeps ticking while suspended, waking the main loop to run fades.
 *
 *******************************************************************************/
 CY_ISR(SleepIsr)
@@ -134,9 +377,26 @@ CY_ISR(SleepIsr)
     SleepTimer_GetStatus();
 }
 
+/*******************************************************************************
+* Function Name: USB_DP_ISR_ExitCallback
+********************************************************************************
+* Summary:
+*  Called from the USBFS Dp interrupt, which USB_Suspend() arms to catch
+*  resume signaling on the bus. Flags the main loop to resume USB.
+*
+*******************************************************************************/
+void USB_DP_ISR_ExitCallback(void)
+{
+    if (0u != usbSuspended && 0u == usbResumePending) {
+        usbWakeStartCycles = DWT->CYCCNT;
+        usbResumePending = 1u;
+    }
+}
+
 int advancePreset(int p) {
     short presetAvailable = 0u;
     int newPreset = p;
+    uint8 switches = readPresetSwitches();
     
     // Go through presets until one is available
     while (!presetAvailable) {
@@ -144,32 +404,7 @@ int advancePreset(int p) {
         newPreset %= 8;
         
         // Check switches to determine if this next preset is available
-        switch(newPreset) {
-            case 0u: 
-                presetAvailable = SW8_Read();
-                break;
-            case 1u:
-                presetAvailable = SW7_Read();
-                break;
-            case 2u:
-                presetAvailable = SW6_Read();
-                break;
-            case 3u:
-                presetAvailable = SW5_Read();
-                break;
-            case 4u:
-                presetAvailable = SW4_Read();
-                break;
-            case 5u:
-                presetAvailable = SW3_Read();
-                break;
-            case 6u:
-                presetAvailable = SW2_Read();
-                break;
-            case 7u:
-                presetAvailable = SW1_Read();
-                break;
-        }
+        presetAvailable = (switches >> newPreset) & 1u;
         
         if (newPreset == p) {
             if (presetAvailable) {
@@ -185,6 +420,1009 @@ int advancePreset(int p) {
     return newPreset; 
 }
 
+/*******************************************************************************
+* Function Name: applyResponseCurve
+********************************************************************************
+* Summary:
+*  Maps a MIDI velocity or pressure (0-127) to a stored brightness (0-127)
+*  through the selected response curve.
+*
+*******************************************************************************/
+uint8 applyResponseCurve(uint8 value) {
+    uint16 inverse;
+    
+    switch (responseCurve) {
+        case CURVE_SOFT:
+            // Rises quickly, most of the range is in light touches
+            inverse = MIDI_MAX_VALUE - value;
+            return MIDI_MAX_VALUE - (inverse * inverse) / MIDI_MAX_VALUE;
+        case CURVE_HARD:
+            // Rises slowly, fine control at low brightness
+            return ((uint16) value * value) / MIDI_MAX_VALUE;
+        default:
+            return value;
+    }
+}
+
+/*******************************************************************************
+* Function Name: applyAftertouch
+********************************************************************************
+* Summary:
+*  Stores the level aftertouch raised a light key to in the current preset,
+*  and records it in the trace.
+*
+*******************************************************************************/
+void applyAftertouch(uint8 key, uint8 level) {
+    storedBrightnesses[preset][key] = level;
+    aftertouchApplied++;
+    traceRecordAftertouch(key, level);
+}
+
+/*******************************************************************************
+* Function Name: applyPendingAftertouch
+********************************************************************************
+* Summary:
+*  Takes a key's pending pressure, clearing it in the same critical section
+*  so a higher pressure arriving from the USB callback isn't lost. Applies
+*  it if it raises the key above the level it already has, so easing off
+*  before the note-off keeps the brightest level reached.
+*
+*******************************************************************************/
+void applyPendingAftertouch(uint8 key) {
+    uint8 pressure;
+    uint8 level;
+
+    uint8 intState = CyEnterCriticalSection();
+    pressure = aftertouchPending[key];
+    aftertouchPending[key] = AFTERTOUCH_NONE;
+    CyExitCriticalSection(intState);
+
+    if (pressure != AFTERTOUCH_NONE) {
+        level = applyResponseCurve(pressure);
+        if (level > storedBrightnesses[preset][key]) {
+            applyAftertouch(key, level);
+        }
+    }
+}
+
+/*******************************************************************************
+* Function Name: serviceAftertouch
+********************************************************************************
+* Summary:
+*  Applies pending aftertouch to the held keys' brightnesses, no more than
+*  once per AFTERTOUCH_INTERVAL_MS per key. The callback only keeps the
+*  highest pressure, so a dense aftertouch stream costs little while USB is
+*  serviced. A note-off applies what is still pending right away.
+*
+*******************************************************************************/
+void serviceAftertouch() {
+    uint32 now = DWT->CYCCNT;
+    uint8 i;
+    
+    for (i = 0u; i < NUM_LIGHTS; i++) {
+        if (aftertouchPending[i] != AFTERTOUCH_NONE &&
+            (now - aftertouchLastCycles[i]) >= AFTERTOUCH_INTERVAL_CYCLES) {
+            if (mode == PRESET_MODE) {
+                applyPendingAftertouch(i);
+            } else {
+                aftertouchPending[i] = AFTERTOUCH_NONE;
+            }
+            aftertouchLastCycles[i] = now;
+        }
+    }
+}
+
+uint16 traceVarintLength(uint16 pos) {
+    uint16 len = 1u;
+    while (traceBuffer[(pos + len - 1u) % TRACE_BUFFER_SIZE] & 0x80u) {
+        len++;
+    }
+    return len;
+}
+
+/*******************************************************************************
+* Function Name: traceDropOldest
+********************************************************************************
+* Summary:
+*  Drops the oldest record, folding a dropped frame into traceBaseFrame.
+*  A dropped state record replaces the base frame, and a dropped gap record
+*  leaves it unknown.
+*  While a dump is in progress only records that have already been sent can
+*  be dropped; returns 0 if the oldest record has not been sent yet.
+*
+*******************************************************************************/
+uint8 traceDropOldest() {
+    uint8 tag = traceBuffer[traceTail];
+    uint16 pos = (traceTail + 1u) % TRACE_BUFFER_SIZE;
+    uint16 recordLen;
+    uint8 i;
+
+    // Skip the tick delta
+    pos = (pos + traceVarintLength(pos)) % TRACE_BUFFER_SIZE;
+
+    switch (tag & TRACE_TAG_MASK) {
+        case TRACE_TAG_FRAME:
+            recordLen = 1u;
+            for (i = 0u; i < FRAME_SIZE; i++) {
+                if (traceBuffer[pos] & (1u << i)) {
+                    recordLen++;
+                }
+            }
+            break;
+        case TRACE_TAG_IDLE:
+        case TRACE_TAG_GAP:
+            recordLen = traceVarintLength(pos);
+            break;
+        case TRACE_TAG_MIDI:
+            recordLen = 3u;
+            break;
+        case TRACE_TAG_AFTERTOUCH:
+            recordLen = 1u;
+            break;
+        case TRACE_TAG_INPUT:
+            recordLen = ((tag & 0x0Fu) == TRACE_INPUT_POT_DIVIDER) ? 2u : 1u;
+            break;
+        default:
+            recordLen = TRACE_STATE_SIZE;
+            break;
+    }
+    recordLen += (pos + TRACE_BUFFER_SIZE - traceTail) % TRACE_BUFFER_SIZE;
+
+    if (traceDumping &&
+        recordLen > (traceDumpRead + TRACE_BUFFER_SIZE - traceTail) % TRACE_BUFFER_SIZE) {
+        return 0u;
+    }
+
+    if ((tag & TRACE_TAG_MASK) == TRACE_TAG_FRAME) {
+        uint8 mask = traceBuffer[pos];
+        traceBaseSledMode = tag & 1u;
+        for (i = 0u; i < FRAME_SIZE; i++) {
+            if (mask & (1u << i)) {
+                pos = (pos + 1u) % TRACE_BUFFER_SIZE;
+                traceBaseFrame[i] = traceBuffer[pos];
+            }
+        }
+    } else if ((tag & TRACE_TAG_MASK) == TRACE_TAG_STATE) {
+        traceBaseSledMode = traceBuffer[(pos + TRACE_STATE_SLED_MODE) % TRACE_BUFFER_SIZE];
+        for (i = 0u; i < FRAME_SIZE; i++) {
+            traceBaseFrame[i] = traceBuffer[(pos + TRACE_STATE_FRAME + i) % TRACE_BUFFER_SIZE];
+        }
+        traceBaseKnown = 1u;
+    } else if ((tag & TRACE_TAG_MASK) == TRACE_TAG_GAP) {
+        traceBaseKnown = 0u;
+    }
+
+    traceTail = (traceTail + recordLen) % TRACE_BUFFER_SIZE;
+    traceUsed -= recordLen;
+    if (traceDropped < 0xFFFFu) {
+        traceDropped++;
+    }
+    return 1u;
+}
+
+/*******************************************************************************
+* Function Name: traceReserve
+********************************************************************************
+* Summary:
+*  Drops the oldest records until len bytes are free in the trace buffer.
+*  Every record is at least two bytes long, so this drops at most len / 2
+*  records. Returns 0 if a dump holds the space that would be needed.
+*
+*******************************************************************************/
+uint8 traceReserve(uint16 len) {
+    while (TRACE_BUFFER_SIZE - traceUsed < len) {
+        if (!traceDropOldest()) {
+            return 0u;
+        }
+    }
+    return 1u;
+}
+
+void tracePut(uint8 value) {
+    traceBuffer[traceHead] = value;
+    traceHead = (traceHead + 1u) % TRACE_BUFFER_SIZE;
+    traceUsed++;
+}
+
+void tracePutVarint(uint32 value) {
+    while (value >= 0x80u) {
+        tracePut((value & 0x7Fu) | 0x80u);
+        value >>= 7;
+    }
+    tracePut(value);
+}
+
+// Moves elapsed time into tracePendingTicks, keeping the remainder cycles
+void traceAdvanceTicks() {
+    uint32 ticks = (DWT->CYCCNT - traceStampCycles) / TRACE_TICK_CYCLES;
+    traceStampCycles += ticks * TRACE_TICK_CYCLES;
+    tracePendingTicks += ticks;
+    traceStateTicks += ticks;
+}
+
+/*******************************************************************************
+* Function Name: traceOpen
+********************************************************************************
+* Summary:
+*  Makes room for a record with up to len payload bytes and writes its tag
+*  and tick delta. If records were lost since the last successful write, a
+*  gap record goes first and a state record is scheduled. Returns 0, and
+*  counts the record as lost, if there is no room.
+*
+*******************************************************************************/
+uint8 traceOpen(uint8 tag, uint8 len) {
+    uint16 gapLen = (traceLost > 0u) ? 1u + 2u * TRACE_VARINT_MAX : 0u;
+
+    if (!traceReserve(gapLen + 1u + TRACE_VARINT_MAX + len)) {
+        if (traceLost < 0xFFFFu) {
+            traceLost++;
+        }
+        return 0u;
+    }
+
+    if (traceLost > 0u) {
+        tracePut(TRACE_TAG_GAP);
+        tracePutVarint(tracePendingTicks);
+        tracePutVarint(traceLost);
+        tracePendingTicks = 0u;
+        traceLost = 0u;
+        traceStateTicks = TRACE_STATE_INTERVAL_TICKS;
+    }
+
+    tracePut(tag);
+    tracePutVarint(tracePendingTicks);
+    tracePendingTicks = 0u;
+    return 1u;
+}
+
+void traceFlushIdle() {
+    if (traceIdleFrames > 0u) {
+        // The idle record carries the ticks up to the last idle frame, the
+        // next record the ticks after it
+        uint32 afterRun = tracePendingTicks;
+        tracePendingTicks = traceIdleTicks;
+        if (traceOpen(TRACE_TAG_IDLE, TRACE_VARINT_MAX)) {
+            tracePutVarint(traceIdleFrames);
+        }
+        tracePendingTicks += afterRun;
+        traceIdleFrames = 0u;
+        traceIdleTicks = 0u;
+    }
+}
+
+/*******************************************************************************
+* Function Name: traceRecordFrame
+********************************************************************************
+* Summary:
+*  Appends the committed output frame to the trace as a delta against the
+*  previous frame, and measures the cycles spent doing so.
+*
+*******************************************************************************/
+void traceRecordFrame() {
+    uint32 startCycles = DWT->CYCCNT;
+    uint8 mask = 0u;
+    uint8 i;
+
+    for (i = 0u; i < FRAME_SIZE; i++) {
+        if (outputFrame[i] != traceLastFrame[i]) {
+            mask |= 1u << i;
+        }
+    }
+
+    uint8 intState = CyEnterCriticalSection();
+    traceAdvanceTicks();
+    if (mask == 0u && outputSledMode == traceLastSledMode) {
+        // Nothing changed, extend the current idle run
+        traceIdleFrames++;
+        traceIdleTicks += tracePendingTicks;
+        tracePendingTicks = 0u;
+        if (traceIdleTicks >= TRACE_IDLE_MAX_TICKS) {
+            traceFlushIdle();
+        }
+    } else {
+        traceFlushIdle();
+        if (traceOpen(TRACE_TAG_FRAME | outputSledMode, 1u + FRAME_SIZE)) {
+            tracePut(mask);
+            for (i = 0u; i < FRAME_SIZE; i++) {
+                if (mask & (1u << i)) {
+                    tracePut(outputFrame[i]);
+                }
+            }
+        }
+        // A lost frame still moves the delta base on; the gap record tells
+        // the decoder it can't follow the frames until the next state record
+        for (i = 0u; i < FRAME_SIZE; i++) {
+            traceLastFrame[i] = outputFrame[i];
+        }
+        traceLastSledMode = outputSledMode;
+    }
+    CyExitCriticalSection(intState);
+
+    traceLastCycles = DWT->CYCCNT - startCycles;
+    if (traceLastCycles > traceMaxCycles) {
+        traceMaxCycles = traceLastCycles;
+    }
+}
+
+void traceRecordMidi(uint8 cable, uint8 *midiMsg) {
+    uint8 intState = CyEnterCriticalSection();
+    traceAdvanceTicks();
+    traceFlushIdle();
+    if (traceOpen(TRACE_TAG_MIDI | (cable & 0x0Fu), 3u)) {
+        tracePut(midiMsg[0]);
+        tracePut(midiMsg[1]);
+        tracePut(midiMsg[2]);
+    }
+    CyExitCriticalSection(intState);
+}
+
+void traceRecordAftertouch(uint8 key, uint8 level) {
+    uint8 intState = CyEnterCriticalSection();
+    traceAdvanceTicks();
+    traceFlushIdle();
+    if (traceOpen(TRACE_TAG_AFTERTOUCH | key, 1u)) {
+        tracePut(level);
+    }
+    CyExitCriticalSection(intState);
+}
+
+void traceRecordInput(uint8 input, uint16 value) {
+    uint8 intState = CyEnterCriticalSection();
+    traceAdvanceTicks();
+    traceFlushIdle();
+    if (traceOpen(TRACE_TAG_INPUT | input, 2u)) {
+        tracePut(LO8(value));
+        if (input == TRACE_INPUT_POT_DIVIDER) {
+            tracePut(HI8(value));
+        }
+    }
+    CyExitCriticalSection(intState);
+}
+
+/*******************************************************************************
+* Function Name: traceRecordState
+********************************************************************************
+* Summary:
+*  Writes a state record when one is due, so a replay can start from it.
+*  Called before rendering a frame. Payload layout:
+*   0      mode
+*   1      preset
+*   2      playback_preset
+*   3      last_preset
+*   4      crossfading
+*   5      hotLeds
+*   6      responseCurve
+*   7      master_level
+*   8      last recorded CROSSFADE_VAL
+*   9      last recorded preset switches
+*   10     sled mode of the last frame
+*   11     aftertouchEnabled
+*   12     settingsShown
+*   13-20  last frame, the base for the deltas that follow
+*   21-76  storedBrightnesses, preset by preset
+*
+*******************************************************************************/
+void traceRecordState() {
+    uint8 i;
+    uint8 j;
+
+    uint8 intState = CyEnterCriticalSection();
+    traceAdvanceTicks();
+    if (traceStateTicks >= TRACE_STATE_INTERVAL_TICKS) {
+        traceFlushIdle();
+        if (traceOpen(TRACE_TAG_STATE, TRACE_STATE_SIZE)) {
+            tracePut(mode);
+            tracePut(preset);
+            tracePut(playback_preset);
+            tracePut(last_preset);
+            tracePut(crossfading);
+            tracePut(hotLeds);
+            tracePut(responseCurve);
+            tracePut(master_level);
+            tracePut(traceLastCrossfade);
+            tracePut(traceLastSwitches);
+            tracePut(traceLastSledMode);
+            tracePut(aftertouchEnabled);
+            tracePut(settingsShown);
+            for (i = 0u; i < FRAME_SIZE; i++) {
+                tracePut(traceLastFrame[i]);
+            }
+            for (i = 0u; i < 8u; i++) {
+                for (j = 0u; j < NUM_LIGHTS; j++) {
+                    tracePut(storedBrightnesses[i][j]);
+                }
+            }
+            traceStateTicks = 0u;
+        }
+    }
+    CyExitCriticalSection(intState);
+}
+
+/*******************************************************************************
+* Function Name: traceStartDump
+********************************************************************************
+* Summary:
+*  Fills in the dump header and marks the records buffered so far for
+*  sending. The dump is a byte stream of the header followed by those
+*  records, oldest first. Header fields are little endian:
+*   0      format version
+*   1-2    record bytes that follow the header
+*   3-4    records dropped because the buffer was full
+*   5      base sled mode, or TRACE_BASE_UNKNOWN if a gap record was
+*          dropped since the last dropped state record
+*   6-13   base frame the first delta applies to
+*   14     number of counters that follow
+*   15-    counters, four bytes each:
+*          0  cycles spent recording the last frame
+*          1  worst case cycles spent recording a frame
+*          2  cycles from the last USB resume signal to USB MIDI running
+*          3  worst case USB wake cycles
+*          4  cycles from the last preset key press to its frame
+*          5  worst case preset programming cycles
+*          6  poly aftertouch messages for held keys
+*          7  poly aftertouch messages that raised a preset level
+*          8  DMX frames sent, 0 without DMX_ENABLED
+*
+*******************************************************************************/
+void traceStartDump() {
+    uint32 counters[TRACE_NUM_COUNTERS];
+    uint8 i;
+
+    uint8 intState = CyEnterCriticalSection();
+    traceFlushIdle();
+    traceDumping = 1u;
+    traceDumpRead = traceTail;
+    traceDumpRemaining = traceUsed;
+
+    traceDumpHeader[0] = TRACE_FORMAT_VERSION;
+    traceDumpHeader[1] = LO8(traceUsed);
+    traceDumpHeader[2] = HI8(traceUsed);
+    traceDumpHeader[3] = LO8(traceDropped);
+    traceDumpHeader[4] = HI8(traceDropped);
+    traceDumpHeader[5] = traceBaseKnown ? traceBaseSledMode : TRACE_BASE_UNKNOWN;
+    for (i = 0u; i < FRAME_SIZE; i++) {
+        traceDumpHeader[6u + i] = traceBaseFrame[i];
+    }
+    CyExitCriticalSection(intState);
+
+    counters[0] = traceLastCycles;
+    counters[1] = traceMaxCycles;
+    counters[2] = usbWakeCycles;
+    counters[3] = usbWakeMaxCycles;
+    counters[4] = programLatencyCycles;
+    counters[5] = programLatencyMaxCycles;
+    counters[6] = aftertouchEvents;
+    counters[7] = aftertouchApplied;
+    #if (DMX_ENABLED)
+        counters[8] = dmxFrameCount;
+    #else
+        counters[8] = 0u;
+    #endif
+
+    traceDumpHeader[14] = TRACE_NUM_COUNTERS;
+    for (i = 0u; i < TRACE_NUM_COUNTERS; i++) {
+        traceDumpHeader[15u + 4u * i] = LO8(LO16(counters[i]));
+        traceDumpHeader[16u + 4u * i] = HI8(LO16(counters[i]));
+        traceDumpHeader[17u + 4u * i] = LO8(HI16(counters[i]));
+        traceDumpHeader[18u + 4u * i] = HI8(HI16(counters[i]));
+    }
+
+    traceDumpHeaderPos = 0u;
+    traceDumpChunk = 0u;
+}
+
+/*******************************************************************************
+* Function Name: traceServiceDump
+********************************************************************************
+* Summary:
+*  Sends the next chunk of the trace dump as a SysEx message. Data is packed
+*  into 7-bit bytes in groups of up to seven: a byte holding the top bits of
+*  the group, then the low seven bits of each byte. Only one chunk is sent per
+*  call so the main loop keeps running while the dump drains.
+*
+*******************************************************************************/
+void traceServiceDump() {
+    uint8 headerLen = TRACE_DUMP_HEADER_SIZE - traceDumpHeaderPos;
+    uint8 rawLen = TRACE_CHUNK_RAW_SIZE;
+    uint8 packedLen = 0u;
+    uint8 i;
+
+    if (headerLen > rawLen) {
+        headerLen = rawLen;
+    }
+    if (traceDumpRemaining < rawLen - headerLen) {
+        rawLen = headerLen + traceDumpRemaining;
+    }
+
+    traceSysex[0] = SYSEX_START;
+    traceSysex[1] = SYSEX_MANUFACTURER_ID;
+    traceSysex[2] = (traceDumpHeaderPos + headerLen == TRACE_DUMP_HEADER_SIZE &&
+                     traceDumpRemaining == rawLen - headerLen) ? TRACE_SYSEX_DUMP_END : TRACE_SYSEX_DUMP_DATA;
+    traceSysex[3] = traceDumpChunk & 0x7Fu;
+
+    for (i = 0u; i < rawLen; i++) {
+        uint8 value;
+        if (i < headerLen) {
+            value = traceDumpHeader[traceDumpHeaderPos + i];
+        } else {
+            value = traceBuffer[(traceDumpRead + i - headerLen) % TRACE_BUFFER_SIZE];
+        }
+
+        if (i % 7u == 0u) {
+            // Start a new group with an empty top-bit byte
+            traceSysex[TRACE_SYSEX_HEADER_SIZE + packedLen] = 0u;
+            packedLen++;
+        }
+        traceSysex[TRACE_SYSEX_HEADER_SIZE + packedLen - (i % 7u) - 1u] |= (value >> 7) << (i % 7u);
+        traceSysex[TRACE_SYSEX_HEADER_SIZE + packedLen] = value & 0x7Fu;
+        packedLen++;
+    }
+
+    if (USB_FALSE == USB_PutUsbMidiIn(TRACE_SYSEX_HEADER_SIZE + packedLen, traceSysex, USB_MIDI_CABLE_00)) {
+        // The sent records may now be dropped to make room for new ones
+        uint8 intState = CyEnterCriticalSection();
+        traceDumpHeaderPos += headerLen;
+        traceDumpRead = (traceDumpRead + rawLen - headerLen) % TRACE_BUFFER_SIZE;
+        traceDumpRemaining -= rawLen - headerLen;
+        traceDumpChunk++;
+        if (traceSysex[2] == TRACE_SYSEX_DUMP_END) {
+            traceDumping = 0u;
+        }
+        CyExitCriticalSection(intState);
+    }
+}
+
+/*******************************************************************************
+* Function Name: readPresetSwitches
+********************************************************************************
+* Summary:
+*  Reads the preset enable switches. Bit n is set when preset n is
+*  available; SW8 enables preset 0 and SW1 preset 7.
+*
+*******************************************************************************/
+uint8 readPresetSwitches() {
+    uint8 switches = 0u;
+    
+    switches |= (0u != SW8_Read()) << 0;
+    switches |= (0u != SW7_Read()) << 1;
+    switches |= (0u != SW6_Read()) << 2;
+    switches |= (0u != SW5_Read()) << 3;
+    switches |= (0u != SW4_Read()) << 4;
+    switches |= (0u != SW3_Read()) << 5;
+    switches |= (0u != SW2_Read()) << 6;
+    switches |= (0u != SW1_Read()) << 7;
+    
+    if (switches != traceLastSwitches) {
+        traceLastSwitches = switches;
+        traceRecordInput(TRACE_INPUT_SWITCHES, switches);
+    }
+    return switches;
+}
+
+// Sets the master brightness from the 6-bit MASTER_POT level
+void setMasterLevel(uint8 level) {
+    if (level != master_level) {
+        traceRecordInput(TRACE_INPUT_MASTER, level);
+    }
+    master_level = level;
+    master_brightness = (float) level/(float) 63.0;
+}
+
+#if (DMX_ENABLED)
+void dmxArmTimer(uint16 us) {
+    DMX_Timer_Stop();
+    DMX_Timer_WriteCounter(us);
+    DMX_Timer_Enable();
+}
+
+/*******************************************************************************
+* Function Name: DmxTimerIsr
+********************************************************************************
+* Summary:
+*  Steps the DMX frame sequence. Waits for the UART FIFO to empty and the
+*  last slot to shift out, then sends the break byte at the slow rate. After
+*  the break byte, restores the slot rate and starts the DMA of the start
+*  code and slots.
+*
+*******************************************************************************/
+CY_ISR(DmxTimerIsr)
+{
+    DMX_Timer_Stop();
+    DMX_Timer_ReadStatusRegister();
+    
+    if (dmxState == DMX_STATE_BREAK) {
+        DMX_Clock_SetDividerRegister(dmxSlotDivider, 0u);
+        dmxState = DMX_STATE_SLOTS;
+        CyDmaChEnable(dmxDmaChannel, 1u);
+    } else if (dmxState == DMX_STATE_DRAIN) {
+        if (0u == (DMX_UART_ReadTxStatus() & DMX_UART_TX_STS_FIFO_EMPTY)) {
+            dmxArmTimer(DMX_SLOT_US);
+        } else {
+            // The last slot may have just moved into the shift register
+            dmxState = DMX_STATE_IDLE;
+            dmxArmTimer(DMX_SLOT_US + DMX_MARGIN_US);
+        }
+    } else {
+        DMX_Clock_SetDividerRegister((dmxSlotDivider + 1u) * DMX_BREAK_DIVIDE - 1u, 0u);
+        DMX_UART_WriteTxData(0x00u);
+        dmxState = DMX_STATE_BREAK;
+        dmxArmTimer(DMX_BREAK_US);
+    }
+}
+
+/*******************************************************************************
+* Function Name: DmxDoneIsr
+********************************************************************************
+* Summary:
+*  Runs when DMX_DMA has queued the last slot. The UART FIFO is polled once
+*  it should have drained.
+*
+*******************************************************************************/
+CY_ISR(DmxDoneIsr)
+{
+    dmxFrameCount++;
+    dmxState = DMX_STATE_DRAIN;
+    dmxArmTimer(DMX_DRAIN_US);
+}
+
+void dmxStart() {
+    dmxFrame[0] = DMX_START_CODE;
+    
+    DMX_UART_Start();
+    dmxSlotDivider = DMX_Clock_GetDividerRegister();
+    
+    // One TD moves the whole frame, one byte per UART FIFO request
+    dmxDmaChannel = DMX_DMA_DmaInitialize(1u, 1u, HI16(CYDEV_SRAM_BASE), HI16(CYDEV_PERIPH_BASE));
+    dmxDmaTd = CyDmaTdAllocate();
+    CyDmaTdSetConfiguration(dmxDmaTd, sizeof(dmxFrame), CY_DMA_DISABLE_TD, TD_INC_SRC_ADR | DMX_DMA__TD_TERMOUT_EN);
+    CyDmaTdSetAddress(dmxDmaTd, LO16((uint32)dmxFrame), LO16((uint32)DMX_UART_TXDATA_PTR));
+    CyDmaChSetInitialTd(dmxDmaChannel, dmxDmaTd);
+    
+    DMX_Done_isr_StartEx(DmxDoneIsr);
+    DMX_Timer_isr_StartEx(DmxTimerIsr);
+    DMX_Timer_Start();
+    dmxArmTimer(DMX_DRAIN_US);
+}
+
+// Patches outputFrame into the DMX universe; DMX_DMA picks it up on the next frame
+void dmxPatchFrame() {
+    uint8 i;
+    
+    for (i = 0u; i < FRAME_SIZE; i++) {
+        if (dmxPatch[i] != DMX_UNPATCHED) {
+            dmxFrame[dmxPatch[i]] = outputFrame[i];
+        }
+    }
+}
+#endif
+
+/*******************************************************************************
+* Function Name: commitOutputFrame
+********************************************************************************
+* Summary:
+*  Writes outputFrame to the lights, control panel and DMX universe, and
+*  records it in the trace.
+*
+*******************************************************************************/
+void commitOutputFrame() {
+    LIGHT_BRIGHTNESS_1_Write(outputFrame[0]);
+    LIGHT_BRIGHTNESS_2_Write(outputFrame[1]);
+    LIGHT_BRIGHTNESS_3_Write(outputFrame[2]);
+    LIGHT_BRIGHTNESS_4_Write(outputFrame[3]);
+    LIGHT_BRIGHTNESS_5_Write(outputFrame[4]);
+    LIGHT_BRIGHTNESS_6_Write(outputFrame[5]);
+    LIGHT_BRIGHTNESS_7_Write(outputFrame[6]);
+    SLED_STATE_SEL_Write(outputSledMode);
+    HOT_LEDS_Write(outputFrame[FRAME_HOT_LEDS]);
+    
+    if (programPending) {
+        programLatencyCycles = DWT->CYCCNT - programStartCycles;
+        if (programLatencyCycles > programLatencyMaxCycles) {
+            programLatencyMaxCycles = programLatencyCycles;
+        }
+        programPending = 0u;
+    }
+    
+    #if (DMX_ENABLED)
+        dmxPatchFrame();
+    #endif
+
+    traceRecordFrame();
+}
+
+/*******************************************************************************
+* Function Name: serviceUsb
+********************************************************************************
+* Summary:
+*  Services USB MIDI and the USB suspend and resume conditions.
+*
+*******************************************************************************/
+void serviceUsb() {
+    // The following code is from the MIDI example
+    
+    /* Host can send double SET_INTERFACE request */
+    if(0u != USB_IsConfigurationChanged())
+    {
+        /* Initialize IN endpoints when device configured */
+        if(0u != USB_GetConfiguration())   
+        {
+            /* Start ISR to determine sleep condition */		
+            Sleep_isr_StartEx(SleepIsr);
+            
+            /* Start SleepTimer's operation */
+            SleepTimer_Start();
+            
+        	/* Enable output endpoint */
+            USB_MIDI_Init();
+        }
+        else
+        {
+            SleepTimer_Stop();
+        }    
+    }        
+    
+    /* Host resumed the bus while suspended */
+    if(0u != usbSuspended && 0u != usbResumePending)
+    {
+        /* Enable USBFS block after suspend */
+        USB_Resume();
+        
+        /* Enable output endpoint */
+        USB_MIDI_Init();
+
+        usbActivityCounter = 0u; /* Re-init USB Activity Counter*/
+        usbSuspended = 0u;
+        usbResumePending = 0u;
+        
+        // USB_MIDI_Init() discards queued IN events, so restart any dump
+        if (0u != traceDumping) {
+            traceDumping = 0u;
+            traceDumpRequested = 1u;
+        }
+        
+        usbWakeCycles = DWT->CYCCNT - usbWakeStartCycles;
+        if (usbWakeCycles > usbWakeMaxCycles) {
+            usbWakeMaxCycles = usbWakeCycles;
+        }
+    }
+    
+    /* Service USB MIDI when device is configured */
+    if(0u != USB_GetConfiguration() && 0u == usbSuspended)    
+    {
+        /* Call this API from UART RX ISR for Auto DMA mode */
+        #if(!USB_EP_MANAGEMENT_DMA_AUTO) 
+            USB_MIDI_IN_Service();
+        #endif
+        /* In Manual EP Memory Management mode OUT_EP_Service() 
+        *  may have to be called from main foreground or from OUT EP ISR
+        */
+        #if(!USB_EP_MANAGEMENT_DMA_AUTO) 
+            USB_MIDI_OUT_Service();
+        #endif
+
+        /* Sending Identity Reply Universal System Exclusive message 
+         * back to computer */
+        if(0u != (USB_MIDI1_InqFlags & USB_INQ_IDENTITY_REQ_FLAG))
+        {
+            USB_PutUsbMidiIn(sizeof(MIDI_IDENTITY_REPLY), \
+                        (uint8 *)MIDI_IDENTITY_REPLY, USB_MIDI_CABLE_00);
+            USB_MIDI1_InqFlags &= ~USB_INQ_IDENTITY_REQ_FLAG;
+        }
+        #if (USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF)
+            if(0u != (USB_MIDI2_InqFlags & USB_INQ_IDENTITY_REQ_FLAG))
+            {
+                USB_PutUsbMidiIn(sizeof(MIDI_IDENTITY_REPLY), \
+                        (uint8 *)MIDI_IDENTITY_REPLY, USB_MIDI_CABLE_01);
+                USB_MIDI2_InqFlags &= ~USB_INQ_IDENTITY_REQ_FLAG;
+            }
+        #endif /* End USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF */
+        
+        /* Sending trace dump back to computer, one chunk per loop */
+        if(0u != traceDumpRequested && 0u == traceDumping)
+        {
+            traceStartDump();
+            traceDumpRequested = 0u;
+        }
+        if(0u != traceDumping)
+        {
+            traceServiceDump();
+        }
+			
+        #if(USB_EP_MANAGEMENT_DMA_AUTO) 
+           #if (USB_MIDI_EXT_MODE >= USB_ONE_EXT_INTRF)
+                MIDI1_UART_DisableRxInt();
+                #if (USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF)
+                    MIDI2_UART_DisableRxInt();
+                #endif /* End USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF */
+            #endif /* End USB_MIDI_EXT_MODE >= USB_ONE_EXT_INTRF */            
+            USB_MIDI_IN_Service();
+            #if (USB_MIDI_EXT_MODE >= USB_ONE_EXT_INTRF)
+                MIDI1_UART_EnableRxInt();
+                #if (USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF)
+                    MIDI2_UART_EnableRxInt();
+                #endif /* End USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF */
+            #endif /* End USB_MIDI_EXT_MODE >= USB_ONE_EXT_INTRF */                
+        #endif
+		
+        /* Check if host requested USB Suspend */
+        if( usbActivityCounter >= USB_SUSPEND_TIMEOUT ) 
+        {    
+            /***************************************************************
+            * Disable USBFS block and set DP Interrupt for wake-up. 
+            * The CPU is not put to sleep: the lights, crossfade and pots 
+            * keep being serviced below, idling between SleepTimer ticks. 
+            * That is well over the 2.5 mA a bus-powered device may draw 
+            * while suspended, so the configuration descriptor reports the 
+            * device as self-powered (bmAttributes 0xC0): the lights' buck 
+            * converters and the PSoC run from the rig's supply. 
+            * The activity counter only gets here once the host has stopped
+            * sending even SOFs, so no OUT transfer is in flight. Events
+            * already received were passed to USB_callbackLocalMidiEvent
+            * by USB_MIDI_OUT_Service above in manual EP management mode,
+            * or by the OUT EP ISR as they arrived in DMA auto mode.
+            ***************************************************************/
+            usbSuspended = 1u;
+            USB_Suspend(); 
+        }
+    }
+}
+
+/*******************************************************************************
+* Function Name: renderOutputFrame
+********************************************************************************
+* Summary:
+*  Works out the light and control panel outputs for the current mode and
+*  commits them.
+*
+*******************************************************************************/
+void renderOutputFrame() {
+    uint8 i;
+    
+    if (mode == PRESET_MODE) {
+        // In preset mode, display brightnesses of that saved preset on the lights
+        for (i = 0u; i < NUM_LIGHTS; i++) {
+            outputFrame[i] = storedBrightnesses[preset][i] * master_brightness;
+        }
+        if (settingsShown) {
+            // Show the response curve and whether aftertouch is on
+            outputSledMode = SLED_MODE_ONE_HOT;
+            outputFrame[FRAME_HOT_LEDS] = 1u << responseCurve;
+            if (aftertouchEnabled) {
+                outputFrame[FRAME_HOT_LEDS] |= SETTINGS_AFTERTOUCH_LED;
+            }
+        } else {
+            // Display the same brightnesses on the control panel
+            outputSledMode = SLED_MODE_BRIGHTNESSES;
+            outputFrame[FRAME_HOT_LEDS] = hotLeds;
+        }
+    } else if (mode == PROGRAM_MODE) {
+        // Don't change the light brightnesses from their last setting in program mode
+        // Set the appropriate control panel LED to "on" at the # of the selected preset
+        outputFrame[FRAME_HOT_LEDS] = 1u << preset;
+        outputSledMode = SLED_MODE_ONE_HOT;
+    } else if (mode == PLAYBACK_MODE && playback_preset >= 8) {
+        // No scenes are turned on.  Display 0 on the lights
+        for (i = 0u; i < NUM_LIGHTS; i++) {
+            outputFrame[i] = 0u;
+        }
+        // Display 0 on the control panel lights
+        outputFrame[FRAME_HOT_LEDS] = 0u;
+        outputSledMode = SLED_MODE_ONE_HOT;
+    } else if (mode == PLAYBACK_MODE && crossfading == 0u) {
+        // In playback mode, display the current preset brightnesses on the light
+        for (i = 0u; i < NUM_LIGHTS; i++) {
+            outputFrame[i] = storedBrightnesses[playback_preset][i] * master_brightness;
+        }
+        // Turn one control panel LED on, for the current selected preset
+        outputSledMode = SLED_MODE_ONE_HOT;
+        outputFrame[FRAME_HOT_LEDS] = 1u << playback_preset;
+    } else if (mode == PLAYBACK_MODE && crossfading == 1u) {
+        // Actively crossfading between presets
+        uint8 crossfade_val = CROSSFADE_VAL_Read();
+        if (crossfade_val != traceLastCrossfade) {
+            traceLastCrossfade = crossfade_val;
+            traceRecordInput(TRACE_INPUT_CROSSFADE, crossfade_val);
+        }
+        if (crossfade_val < 255 && last_preset < 8) {
+            float fraction = crossfade_val/255.0;
+            // Interpolate between the two presets
+            for (i = 0u; i < NUM_LIGHTS; i++) {
+                outputFrame[i] = (fraction * storedBrightnesses[playback_preset][i] + (1.0-fraction) * storedBrightnesses[last_preset][i]) * master_brightness;
+            }
+        } else {
+            // Crossfade over, move to next preset fully
+            for (i = 0u; i < NUM_LIGHTS; i++) {
+                outputFrame[i] = storedBrightnesses[playback_preset][i] * master_brightness;
+            }
+            CROSSFADE_CTRL_Write(2u); // Reset = true, Enable = false
+            crossfading = 0u;
+        }
+        // Status LEDs should just turn on LED for next preset
+        outputSledMode = SLED_MODE_ONE_HOT;
+        outputFrame[FRAME_HOT_LEDS] = 1u << playback_preset;
+    }
+    
+    commitOutputFrame();
+}
+
+/*******************************************************************************
+* Function Name: servicePots
+********************************************************************************
+* Summary:
+*  Reads the crossfade speed and master brightness potentiometers.
+*
+*******************************************************************************/
+void servicePots() {
+    if (POT_VALUE_IsEndConversion(POT_VALUE_RETURN_STATUS)) {
+        uint8 potValue = POT_VALUE_GetResult8();
+        
+        int diff = potValue - last_pot_value;
+        diff = diff > 0 ? diff : -diff;
+
+        // Check if potentiometer has seen a significant change
+        if (diff > 16) {
+            
+            last_pot_value = potValue;
+
+            // pot value of 255 (LEFT) = 50kHz
+            // pot value of 0 (RIGHT) = 50Hz
+            
+            // Set crossfade clock to appropriate frequency
+            uint16 divider = (1998 * potValue)/255 + 2;
+            if (divider > 2000) {
+                divider = 2000;
+            }
+            if (divider < 2) {
+                divider = 2;
+            }
+            
+            if (divider != last_divider) {
+                Crossfade_Clock_SetDividerRegister(divider, 0u);
+                last_divider = divider;
+                traceRecordInput(TRACE_INPUT_POT_DIVIDER, divider);
+            }
+        }
+    }
+    
+    if (MASTER_POT_IsEndConversion(POT_VALUE_RETURN_STATUS)) {
+        uint8 masterValue8 = MASTER_POT_GetResult8();
+        uint8 masterShifted = masterValue8 >> 2;
+        setMasterLevel(masterShifted);
+    }
+}
+
+/*******************************************************************************
+* Function Name: serviceMainLoop
+********************************************************************************
+* Summary:
+*  One pass of the main loop.
+*
+*******************************************************************************/
+void serviceMainLoop() {
+    serviceUsb();
+    
+    // Update the duty cycle of the buck converter, if necessary
+    Lights_Out_1_Poll();
+    
+    serviceAftertouch();
+    
+    traceRecordState();
+    renderOutputFrame();
+    
+    servicePots();
+    
+    if (0u != usbSuspended) {
+        // Idle until the next SleepTimer tick or Dp wake-up interrupt. The
+        // check is made with interrupts masked so a resume can't slip in
+        // between it and WFI; a pending interrupt still ends the WFI.
+        uint8 intState = CyEnterCriticalSection();
+        if (0u == usbResumePending) {
+            __WFI();
+        }
+        CyExitCriticalSection(intState);
+    }
+}
+
 /*******************************************************************************
 * Function Name: main
 ********************************************************************************
@@ -207,231 +1445,27 @@ int main()
 
     LEDs_Out_1_Start();
     Lights_Out_1_Start();
+    #if (DMX_ENABLED)
+        dmxStart();
+    #endif
     
     POT_VALUE_Start();
     POT_VALUE_StartConvert();
     
     MASTER_POT_Start();
     MASTER_POT_StartConvert();
-            
+    
+    // Enable the cycle counter used to measure trace overhead
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0u;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
     while(1u)
     {
-        // The following code is from the MIDI example
-        
-        /* Host can send double SET_INTERFACE request */
-        if(0u != USB_IsConfigurationChanged())
-        {
-            /* Initialize IN endpoints when device configured */
-            if(0u != USB_GetConfiguration())   
-            {
-                /* Start ISR to determine sleep condition */		
-                Sleep_isr_StartEx(SleepIsr);
-                
-                /* Start SleepTimer's operation */
-                SleepTimer_Start();
-                
-            	/* Enable output endpoint */
-                USB_MIDI_Init();
-            }
-            else
-            {
-                SleepTimer_Stop();
-            }    
-        }        
-        
-        /* Service USB MIDI when device is configured */
-        if(0u != USB_GetConfiguration())    
-        {
-            /* Call this API from UART RX ISR for Auto DMA mode */
-            #if(!USB_EP_MANAGEMENT_DMA_AUTO) 
-                USB_MIDI_IN_Service();
-            #endif
-            /* In Manual EP Memory Management mode OUT_EP_Service() 
-            *  may have to be called from main foreground or from OUT EP ISR
-            */
-            #if(!USB_EP_MANAGEMENT_DMA_AUTO) 
-                USB_MIDI_OUT_Service();
-            #endif
-
-            /* Sending Identity Reply Universal System Exclusive message 
-             * back to computer */
-            if(0u != (USB_MIDI1_InqFlags & USB_INQ_IDENTITY_REQ_FLAG))
-            {
-                USB_PutUsbMidiIn(sizeof(MIDI_IDENTITY_REPLY), \
-                            (uint8 *)MIDI_IDENTITY_REPLY, USB_MIDI_CABLE_00);
-                USB_MIDI1_InqFlags &= ~USB_INQ_IDENTITY_REQ_FLAG;
-            }
-            #if (USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF)
-                if(0u != (USB_MIDI2_InqFlags & USB_INQ_IDENTITY_REQ_FLAG))
-                {
-                    USB_PutUsbMidiIn(sizeof(MIDI_IDENTITY_REPLY), \
-                            (uint8 *)MIDI_IDENTITY_REPLY, USB_MIDI_CABLE_01);
-                    USB_MIDI2_InqFlags &= ~USB_INQ_IDENTITY_REQ_FLAG;
-                }
-            #endif /* End USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF */
-    			
-            #if(USB_EP_MANAGEMENT_DMA_AUTO) 
-               #if (USB_MIDI_EXT_MODE >= USB_ONE_EXT_INTRF)
-                    MIDI1_UART_DisableRxInt();
-                    #if (USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF)
-                        MIDI2_UART_DisableRxInt();
-                    #endif /* End USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF */
-                #endif /* End USB_MIDI_EXT_MODE >= USB_ONE_EXT_INTRF */            
-                USB_MIDI_IN_Service();
-                #if (USB_MIDI_EXT_MODE >= USB_ONE_EXT_INTRF)
-                    MIDI1_UART_EnableRxInt();
-                    #if (USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF)
-                        MIDI2_UART_EnableRxInt();
-                    #endif /* End USB_MIDI_EXT_MODE >= USB_TWO_EXT_INTRF */
-                #endif /* End USB_MIDI_EXT_MODE >= USB_ONE_EXT_INTRF */                
-            #endif
-    		
-            /* Check if host requested USB Suspend */
-            if( usbActivityCounter >= USB_SUSPEND_TIMEOUT ) 
-            {    
-           
-                /***************************************************************
-                * Disable USBFS block and set DP Interrupt for wake-up 
-                * from sleep mode. 
-                ***************************************************************/
-                USB_Suspend(); 
-                /* Prepares system clocks for sleep mode */
-                CyPmSaveClocks();
-                /***************************************************************
-                * Switch to the Sleep Mode for the PSoC 3 or PSoC 5LP devices:
-                *  - PM_SLEEP_TIME_NONE: wakeup time is defined by PICU source
-                *  - PM_SLEEP_SRC_PICU: PICU wakeup source 
-                ***************************************************************/
-                CyPmSleep(PM_SLEEP_TIME_NONE, PM_SLEEP_SRC_PICU);
-                /* Restore clock configuration */
-                CyPmRestoreClocks();
-                /* Enable USBFS block after power-down mode */
-                USB_Resume();
-                
-                /* Enable output endpoint */
-                USB_MIDI_Init();
-
-                usbActivityCounter = 0u; /* Re-init USB Activity Counter*/
-            }
-        }
-        
-        // Update the duty cycle of the buck converter, if necessary
-        Lights_Out_1_Poll();
-        
-        if (mode == PRESET_MODE) {
-            // In preset mode, display brightnesses of that saved preset on the lights
-            LIGHT_BRIGHTNESS_1_Write(storedBrightnesses[preset][0] * master_brightness);
-            LIGHT_BRIGHTNESS_2_Write(storedBrightnesses[preset][1] * master_brightness);
-            LIGHT_BRIGHTNESS_3_Write(storedBrightnesses[preset][2] * master_brightness);
-            LIGHT_BRIGHTNESS_4_Write(storedBrightnesses[preset][3] * master_brightness);
-            LIGHT_BRIGHTNESS_5_Write(storedBrightnesses[preset][4] * master_brightness);
-            LIGHT_BRIGHTNESS_6_Write(storedBrightnesses[preset][5] * master_brightness);
-            LIGHT_BRIGHTNESS_7_Write(storedBrightnesses[preset][6] * master_brightness);
-            // Display the same brightnesses on the control panel
-            SLED_STATE_SEL_Write(SLED_MODE_BRIGHTNESSES);
-            HOT_LEDS_Write(hotLeds);
-        } else if (mode == PROGRAM_MODE) {
-            // Don't change the light brightnesses from their last setting in program mode
-            // Set the appropriate control panel LED to "on" at the # of the selected preset
-            uint8 hotPreset = 1u << preset;
-            HOT_LEDS_Write(hotPreset);
-            SLED_STATE_SEL_Write(SLED_MODE_ONE_HOT);
-        } else if (mode == PLAYBACK_MODE && playback_preset >= 8) {
-            // No scenes are turned on.  Display 0 on the lights
-            LIGHT_BRIGHTNESS_1_Write(0u);
-            LIGHT_BRIGHTNESS_2_Write(0u);
-            LIGHT_BRIGHTNESS_3_Write(0u);
-            LIGHT_BRIGHTNESS_4_Write(0u);
-            LIGHT_BRIGHTNESS_5_Write(0u);
-            LIGHT_BRIGHTNESS_6_Write(0u);
-            LIGHT_BRIGHTNESS_7_Write(0u);
-            // Display 0 on the control panel lights
-            HOT_LEDS_Write(0u);
-            SLED_STATE_SEL_Write(SLED_MODE_ONE_HOT);
-        } else if (mode == PLAYBACK_MODE && crossfading == 0u) {
-            // In playback mode, display the current preset brightnesses on the light
-            LIGHT_BRIGHTNESS_1_Write(storedBrightnesses[playback_preset][0] * master_brightness);
-            LIGHT_BRIGHTNESS_2_Write(storedBrightnesses[playback_preset][1] * master_brightness);
-            LIGHT_BRIGHTNESS_3_Write(storedBrightnesses[playback_preset][2] * master_brightness);
-            LIGHT_BRIGHTNESS_4_Write(storedBrightnesses[playback_preset][3] * master_brightness);
-            LIGHT_BRIGHTNESS_5_Write(storedBrightnesses[playback_preset][4] * master_brightness);
-            LIGHT_BRIGHTNESS_6_Write(storedBrightnesses[playback_preset][5] * master_brightness);
-            LIGHT_BRIGHTNESS_7_Write(storedBrightnesses[playback_preset][6] * master_brightness);
-            // Turn one control panel LED on, for the current selected preset
-            SLED_STATE_SEL_Write(SLED_MODE_ONE_HOT);
-            uint8 hotPreset = 1u << playback_preset; 
-            HOT_LEDS_Write(hotPreset);
-        } else if (mode == PLAYBACK_MODE && crossfading == 1u) {
-            // Actively crossfading between presets
-            uint8 crossfade_val = CROSSFADE_VAL_Read();
-            if (crossfade_val < 255 && last_preset < 8) {
-                float fraction = crossfade_val/255.0;
-                // Interpolate between the two presets
-                LIGHT_BRIGHTNESS_1_Write((fraction * storedBrightnesses[playback_preset][0] + (1.0-fraction) * storedBrightnesses[last_preset][0]) * master_brightness);
-                LIGHT_BRIGHTNESS_2_Write((fraction * storedBrightnesses[playback_preset][1] + (1.0-fraction) * storedBrightnesses[last_preset][1]) * master_brightness);
-                LIGHT_BRIGHTNESS_3_Write((fraction * storedBrightnesses[playback_preset][2] + (1.0-fraction) * storedBrightnesses[last_preset][2]) * master_brightness);
-                LIGHT_BRIGHTNESS_4_Write((fraction * storedBrightnesses[playback_preset][3] + (1.0-fraction) * storedBrightnesses[last_preset][3]) * master_brightness);
-                LIGHT_BRIGHTNESS_5_Write((fraction * storedBrightnesses[playback_preset][4] + (1.0-fraction) * storedBrightnesses[last_preset][4]) * master_brightness);
-                LIGHT_BRIGHTNESS_6_Write((fraction * storedBrightnesses[playback_preset][5] + (1.0-fraction) * storedBrightnesses[last_preset][5]) * master_brightness);
-                LIGHT_BRIGHTNESS_7_Write((fraction * storedBrightnesses[playback_preset][6] + (1.0-fraction) * storedBrightnesses[last_preset][6]) * master_brightness);
-            } else {
-                // Crossfade over, move to next preset fully
-                LIGHT_BRIGHTNESS_1_Write(storedBrightnesses[playback_preset][0] * master_brightness);
-                LIGHT_BRIGHTNESS_2_Write(storedBrightnesses[playback_preset][1] * master_brightness);
-                LIGHT_BRIGHTNESS_3_Write(storedBrightnesses[playback_preset][2] * master_brightness);
-                LIGHT_BRIGHTNESS_4_Write(storedBrightnesses[playback_preset][3] * master_brightness);
-                LIGHT_BRIGHTNESS_5_Write(storedBrightnesses[playback_preset][4] * master_brightness);
-                LIGHT_BRIGHTNESS_6_Write(storedBrightnesses[playback_preset][5] * master_brightness);
-                LIGHT_BRIGHTNESS_7_Write(storedBrightnesses[playback_preset][6] * master_brightness);
-                CROSSFADE_CTRL_Write(2u); // Reset = true, Enable = false
-                crossfading = 0u;
-            }
-            // Status LEDs should just turn on LED for next preset
-            SLED_STATE_SEL_Write(SLED_MODE_ONE_HOT);
-            uint8 hotPreset = 1u << playback_preset; 
-            HOT_LEDS_Write(hotPreset);
-        }
-
-        if (POT_VALUE_IsEndConversion(POT_VALUE_RETURN_STATUS)) {
-            uint8 potValue = POT_VALUE_GetResult8();
-            
-            int diff = potValue - last_pot_value;
-            diff = diff > 0 ? diff : -diff;
-
-            // Check if potentiometer has seen a significant change
-            if (diff > 16) {
-                
-                last_pot_value = potValue;
-
-                // pot value of 255 (LEFT) = 50kHz
-                // pot value of 0 (RIGHT) = 50Hz
-                
-                // Set crossfade clock to appropriate frequency
-                uint16 divider = (1998 * potValue)/255 + 2;
-                if (divider > 2000) {
-                    divider = 2000;
-                }
-                if (divider < 2) {
-                    divider = 2;
-                }
-                
-                if (divider != last_divider) {
-                    Crossfade_Clock_SetDividerRegister(divider, 0u);
-                    last_divider = divider;
-                }
-            }
-        }
-        
-        if (MASTER_POT_IsEndConversion(POT_VALUE_RETURN_STATUS)) {
-            uint8 masterValue8 = MASTER_POT_GetResult8();
-            uint8 masterShifted = masterValue8 >> 2;
-            master_brightness = (float) masterShifted/(float) 63.0;
-        }
-        
+        serviceMainLoop();
     }
 }
 
-
 /*******************************************************************************
 * Function Name: USB_callbackLocalMidiEvent
 ********************************************************************************
@@ -444,6 +1478,13 @@ void USB_callbackLocalMidiEvent(uint8 cable, uint8 *midiMsg) CYREENTRANT
     short isLightKey = 0u;
     
     short isNoteOn = (midiMsg[MIDI_MSG_TYPE] == USB_MIDI_NOTE_ON) && (midiMsg[MIDI_NOTE_VELOCITY] != 0u);
+    short isNoteOff = (midiMsg[MIDI_MSG_TYPE] == USB_MIDI_NOTE_OFF) ||
+        ((midiMsg[MIDI_MSG_TYPE] == USB_MIDI_NOTE_ON) && (midiMsg[MIDI_NOTE_VELOCITY] == 0u));
+    
+    // Trace dump request: F0 7D 01 F7
+    if (midiMsg[0] == SYSEX_START && midiMsg[1] == SYSEX_MANUFACTURER_ID && midiMsg[2] == TRACE_SYSEX_DUMP_REQ) {
+        traceDumpRequested = 1u;
+    }
     
     // Decode midi note number into action
     switch (midiMsg[MIDI_NOTE_NUMBER]) {
@@ -496,6 +1537,23 @@ void USB_callbackLocalMidiEvent(uint8 cable, uint8 *midiMsg) CYREENTRANT
                 }
             }
             break;
+        case CURVE_BUTTON :
+            if (mode == PRESET_MODE && isNoteOn == 1u) {
+                responseCurve++;
+                responseCurve %= NUM_CURVES;
+                settingsShown = 1u;
+            } else if (isNoteOff) {
+                settingsShown = 0u;
+            }
+            break;
+        case AFTERTOUCH_BUTTON :
+            if (mode == PRESET_MODE && isNoteOn == 1u) {
+                aftertouchEnabled = !aftertouchEnabled;
+                settingsShown = 1u;
+            } else if (isNoteOff) {
+                settingsShown = 0u;
+            }
+            break;
         case PRESET_BUTTON :
             if (isNoteOn == 1u) {
                 if (mode == PRESET_MODE) {
@@ -528,20 +1586,38 @@ void USB_callbackLocalMidiEvent(uint8 cable, uint8 *midiMsg) CYREENTRANT
     uint8 oneHotKey = 1u << keyNumber;    
     
     if (mode == PRESET_MODE && isLightKey) {
-        if (midiMsg[MIDI_MSG_TYPE] == USB_MIDI_NOTE_OFF || 
-            (midiMsg[MIDI_MSG_TYPE] == USB_MIDI_NOTE_ON && midiMsg[MIDI_NOTE_VELOCITY] == 0u)) {
-            // Set control LED to active
+        if (isNoteOff) {
+            // Set control LED to off, keeping the last brightness and any
+            // higher pressure that hasn't reached its aftertouch interval
             hotLeds &= ~(oneHotKey);
-            
-            // Update stored brightnesses based on stopping point in brightness ramp
-            storedBrightnesses[preset][keyNumber] = BRIGHTNESS_RAMP_VDAC8_Data >> 1;
+            applyPendingAftertouch(keyNumber);
         } else if (midiMsg[MIDI_MSG_TYPE] == USB_MIDI_NOTE_ON) {
-            // Set control LED to off
+            // Set control LED to active
             currentKeyNumber = keyNumber;
             hotLeds |= oneHotKey;
+            
+            // Store brightness from the key velocity
+            storedBrightnesses[preset][keyNumber] = applyResponseCurve(midiMsg[MIDI_NOTE_VELOCITY]);
+            aftertouchPending[keyNumber] = AFTERTOUCH_NONE;
+            programStartCycles = DWT->CYCCNT;
+            programPending = 1u;
+        } else if (midiMsg[MIDI_MSG_TYPE] == USB_MIDI_POLY_KEY_PRESSURE && aftertouchEnabled &&
+                   (hotLeds & oneHotKey)) {
+            // Pressing harder on a held key brightens it, see serviceAftertouch
+            if (aftertouchPending[keyNumber] == AFTERTOUCH_NONE ||
+                midiMsg[MIDI_NOTE_VELOCITY] > aftertouchPending[keyNumber]) {
+                aftertouchPending[keyNumber] = midiMsg[MIDI_NOTE_VELOCITY];
+            }
+            aftertouchEvents++;
         }
     }
     
+    // Recorded after handling, so inputs read while handling it come first.
+    // Poly pressure is left out, applyAftertouch records what it changed.
+    if (midiMsg[MIDI_MSG_TYPE] != USB_MIDI_POLY_KEY_PRESSURE) {
+        traceRecordMidi(cable, midiMsg);
+    }
+    
     inqFlagsOld = USB_MIDI1_InqFlags;
     cable = cable;
 }    